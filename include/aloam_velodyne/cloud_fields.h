@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include "aloam_velodyne/common.h"
+
+// Field of a sensor_msgs::PointCloud2, offset is -1 if the cloud has no
+// field with that name.
+struct CloudField
+{
+    int offset = -1;
+    std::uint8_t datatype = 0;
+
+    bool valid() const
+    {
+        return offset >= 0;
+    }
+};
+
+CloudField findCloudField(const sensor_msgs::PointCloud2 &msg, const std::string &name);
+
+// value of a field of the point starting at data, converted to double
+double readCloudField(const std::uint8_t *data, const CloudField &field);
+
+// Decodes x, y and z of a cloud in one pass and drops NaN points and points
+// closer than minimumRange on the way, so the result can go straight to
+// FeatureExtractor::extractFiltered(). cloudOut keeps its memory between
+// calls. Returns false if the cloud has no x, y or z field or the message
+// holds fewer bytes than its width, height and steps claim.
+bool decodeXYZCloud(const sensor_msgs::PointCloud2 &msg, double minimumRange,
+                    pcl::PointCloud<pcl::PointXYZ> &cloudOut);
+
+// Reads a cloud whose driver already tags every point with its scan line and
+// capture time, like the ring and t fields of the Ouster driver or ring and
+// time of the Velodyne driver. NaN points, points closer than minimumRange
+// and points with a ring outside [0, nScans) are skipped. The time field may
+// have any unit and origin, it is normalised over the sweep, so intensity is
+// ring + scanPeriod * relTime like in the rest of the pipeline.
+// Returns false if one of the fields is missing or the message is truncated.
+bool decodeRingTimeCloud(const sensor_msgs::PointCloud2 &msg, const std::string &ringField,
+                         const std::string &timeField, int nScans, double scanPeriod,
+                         double minimumRange, pcl::PointCloud<PointType> &cloudOut);
+
+// Same for one segment of a streamed sweep. relTime of a point is timeOrigin
+// plus timeScale times its time field, e.g. 1e-9 for the nanoseconds of the
+// Ouster t field. timeOrigin is where the time field counts from, in seconds
+// after the start of the sweep: 0 for a field measured from the sweep start
+// like the Ouster t field, the offset of the segment stamp for a field
+// measured from the segment.
+bool decodeRingTimeSegment(const sensor_msgs::PointCloud2 &msg, const std::string &ringField,
+                           const std::string &timeField, double timeScale, double timeOrigin,
+                           int nScans, double scanPeriod, double minimumRange,
+                           pcl::PointCloud<PointType> &cloudOut);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include <pcl/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <pcl_ros/point_cloud.h>
+#include <ros/ros.h>
+
+#include "aloam_velodyne/common.h"
+
+// Clouds between the stages are published as pcl::PointCloud through
+// pcl_ros. When the stages run as nodelets in one manager, subscribers get
+// the published pointer itself instead of a serialized copy, so a cloud must
+// not be changed any more once it is published. pcl headers store the stamp
+// in microseconds.
+
+inline void setCloudHeader(pcl::PointCloud<PointType> &cloud, const ros::Time &stamp, const std::string &frameId)
+{
+    cloud.header.stamp = pcl_conversions::toPCL(stamp);
+    cloud.header.frame_id = frameId;
+}
+
+// stamp of a published cloud in seconds
+inline double cloudTime(const pcl::PointCloud<PointType> &cloud)
+{
+    return pcl_conversions::fromPCL(cloud.header.stamp).toSec();
+}
+
+// copy of a cloud the caller keeps using, ready to publish
+inline pcl::PointCloud<PointType>::Ptr makeCloudMsg(const pcl::PointCloud<PointType> &cloud, const ros::Time &stamp,
+                                                    const std::string &frameId)
+{
+    pcl::PointCloud<PointType>::Ptr cloudMsg(new pcl::PointCloud<PointType>(cloud));
+    setCloudHeader(*cloudMsg, stamp, frameId);
+    return cloudMsg;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+// Kernels for the LOAM curvature of every point, i.e. the squared norm of
+// the sum of the 10 neighbours minus 10 times the point itself.
+//   Reference  : plain 11 tap loop
+//   RunningSum : sliding window sum, two adds per point, double accumulator.
+//                Equal to Reference up to float rounding. It has a loop carried
+//                dependency, so on x86 the SIMD kernels are faster.
+//   SSE, AVX2  : 11 tap loop on 4 or 8 points at once, same summation order
+//                as Reference, so the results are bit identical to it
+enum class CurvatureKernel
+{
+    Reference,
+    RunningSum,
+    SSE,
+    AVX2
+};
+
+bool curvatureKernelSupported(CurvatureKernel kernel);
+
+// fastest kernel giving the same result as Reference on this cpu
+CurvatureKernel bestCurvatureKernel();
+
+// accepts "reference", "running_sum", "sse", "avx2" and "auto"
+bool parseCurvatureKernel(const std::string &name, CurvatureKernel &kernel);
+
+const char *curvatureKernelName(CurvatureKernel kernel);
+
+// x, y and z hold the n points as structure of arrays, curvature is written
+// for the indices [5, n - 5) only
+void computeCurvature(CurvatureKernel kernel, const float *x, const float *y, const float *z,
+                      int n, float *curvature);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "aloam_velodyne/feature_extractor.h"
+
+// Picks the feature budget of the next sweep so that the measured latency
+// of the front end stays at a target. The budget moves between minBudget and
+// maxBudget along one load level, 1 is the maximum budget. Latencies are
+// smoothed, and errors within the dead band leave the level alone so the
+// budget does not flip between neighbouring counts every sweep.
+class FeatureBudgetController
+{
+  public:
+    struct Options
+    {
+        // ms, 0 keeps the maximum budget
+        double targetLatency = 0;
+        FeatureExtractor::Budget minBudget;
+        FeatureExtractor::Budget maxBudget;
+        // level change per relative latency error
+        double gain = 0.5;
+        // weight of the newest latency in the smoothed one
+        double smoothing = 0.3;
+        double deadBand = 0.05;
+    };
+
+    explicit FeatureBudgetController(const Options &options);
+
+    // latency of one sweep in ms
+    void addLatency(double latency);
+
+    const FeatureExtractor::Budget &budget() const
+    {
+        return currentBudget;
+    }
+
+    double level() const
+    {
+        return currentLevel;
+    }
+
+    double smoothedLatency() const
+    {
+        return latency;
+    }
+
+    // at the minimum budget and still over the target
+    bool saturated() const;
+
+    Options options;
+
+  private:
+    void updateBudget();
+
+    double currentLevel = 1;
+    double latency = 0;
+    bool hasLatency = false;
+    FeatureExtractor::Budget currentBudget;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include "aloam_velodyne/FeatureBundle.h"
+#include "aloam_velodyne/common.h"
+
+// Packs the full cloud and the four feature sets of a sweep into one
+// message, so they are serialized once and arrive together.
+// bundle is scratch memory that can be kept between sweeps.
+inline void packFeatureBundle(const pcl::PointCloud<PointType> *const sets[aloam_velodyne::FeatureBundle::NUM_SETS],
+                              pcl::PointCloud<PointType> &bundle, aloam_velodyne::FeatureBundle &msg)
+{
+    const int numSets = aloam_velodyne::FeatureBundle::NUM_SETS;
+    size_t numPoints = 0;
+    for (int i = 0; i < numSets; i++)
+        numPoints += sets[i]->size();
+
+    bundle.clear();
+    bundle.reserve(numPoints);
+    msg.offsets[0] = 0;
+    for (int i = 0; i < numSets; i++)
+    {
+        bundle += *sets[i];
+        msg.offsets[i + 1] = bundle.size();
+    }
+    pcl::toROSMsg(bundle, msg.cloud);
+}
+
+// Splits a bundle back into its sets, returns false if the offsets do not
+// match the cloud.
+inline bool unpackFeatureBundle(const aloam_velodyne::FeatureBundle &msg, pcl::PointCloud<PointType> &bundle,
+                                pcl::PointCloud<PointType> *const sets[aloam_velodyne::FeatureBundle::NUM_SETS])
+{
+    const int numSets = aloam_velodyne::FeatureBundle::NUM_SETS;
+    pcl::fromROSMsg(msg.cloud, bundle);
+    if (msg.offsets[0] != 0 || msg.offsets[numSets] != bundle.size())
+        return false;
+
+    for (int i = 0; i < numSets; i++)
+    {
+        if (msg.offsets[i + 1] < msg.offsets[i])
+            return false;
+        sets[i]->points.assign(bundle.points.begin() + msg.offsets[i], bundle.points.begin() + msg.offsets[i + 1]);
+        sets[i]->width = sets[i]->points.size();
+        sets[i]->height = 1;
+        sets[i]->is_dense = true;
+    }
+    return true;
+}
@@ -0,0 +1,213 @@
+// This is an advanced implementation of the algorithm described in the following paper:
+//   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
+//     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
+
+// Modifier: Tong Qin               qintonguav@gmail.com
+// 	         Shaozu Cao 		    saozu.cao@connect.ust.hk
+
+
+// Copyright 2013, Ji Zhang, Carnegie Mellon University
+// Further contributions copyright (c) 2016, Southwest Research Institute
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "aloam_velodyne/common.h"
+#include "aloam_velodyne/curvature.h"
+#include "aloam_velodyne/range_image.h"
+#include "aloam_velodyne/scan_line_downsampler.h"
+#include "aloam_velodyne/thread_pool.h"
+#include "aloam_velodyne/tic_toc.h"
+
+// features of one sweep, intensity of every point is scanID + scanPeriod * relTime
+struct LaserFeatures
+{
+    // all points, ordered by scan line, rangeImage indexes into it
+    pcl::PointCloud<PointType> laserCloud;
+    RangeImage rangeImage;
+    pcl::PointCloud<PointType> cornerPointsSharp;
+    pcl::PointCloud<PointType> cornerPointsLessSharp;
+    pcl::PointCloud<PointType> surfPointsFlat;
+    pcl::PointCloud<PointType> surfPointsLessFlat;
+
+    // timing of the last extraction in ms, timeSelectQ covers picking sharp and flat points
+    double timePrepare = 0;
+    double timeSelectQ = 0;
+    double timeSeparate = 0;
+
+    void clear();
+};
+
+// Splits a sweep into scan lines and picks edge and planar features.
+// Points are sorted into the rows of a range image with one counting sort
+// pass, the rows are then processed directly. All working memory is owned by the instance and reused between sweeps, so
+// several extractors can run concurrently in one process. With a thread pool
+// set, the scan lines of one sweep are processed in parallel and merged in
+// scan order, which gives the same output as the serial path.
+class FeatureExtractor
+{
+  public:
+    // features picked per sextant of a scan line, lessSharp includes the
+    // sharp ones. Points above the curvature threshold are edge candidates,
+    // points below it planar candidates.
+    struct Budget
+    {
+        int sharp = 2;
+        int lessSharp = 20;
+        int flat = 4;
+        double curvatureThreshold = 0.1;
+    };
+
+    // column wise ground segmentation on the range image. A point below the
+    // sensor is ground when the slope to the point in the same column of a
+    // neighbouring scan line is at most maxSlope degrees. Ground points are
+    // mostly redundant planar features, so fewer of them are kept.
+    struct Ground
+    {
+        bool enabled = false;
+        double maxSlope = 10;
+        // flat features per sextant that may be ground points
+        int flat = 1;
+        // leaf size of the less flat filter for ground points, 0.2 for the others
+        double leafSize = 0.6;
+    };
+
+    struct Options
+    {
+        int nScans = 16;
+        double scanPeriod = 0.1;
+        // azimuth bins of the range image
+        int horizontalResolution = 1800;
+        CurvatureKernel curvatureKernel = CurvatureKernel::Reference;
+        // may be changed between sweeps
+        Budget budget;
+        Ground ground;
+    };
+
+    explicit FeatureExtractor(const Options &options);
+
+    // pool is not owned, nullptr processes scan lines serially
+    void setThreadPool(ThreadPool *pool);
+
+    // scan line formulas of extractFiltered() exist only for these sensors,
+    // extractTagged() works with any number of scan lines
+    static bool isSupportedScanNum(int nScans);
+
+    // laserCloudIn must already be free of NaN and too close points, e.g. from
+    // decodeXYZCloud(), it is read in place without a copy. Scan line and time
+    // of every point are computed from its angles.
+    void extractFiltered(const pcl::PointCloud<pcl::PointXYZ> &laserCloudIn, LaserFeatures &features);
+
+    // points already carry scanID + scanPeriod * relTime in intensity, e.g.
+    // from the ring and time fields of the driver, see decodeRingTimeCloud()
+    void extractTagged(const pcl::PointCloud<PointType> &laserCloudIn, LaserFeatures &features);
+
+    // Streaming input for lower latency: the sweep arrives in segments, e.g.
+    // column packets or angular sectors, tagged like for extractTagged() with
+    // relTime over the whole sweep and in capture order within a scan line.
+    // A sextant is processed as soon as its points and the 5 after it are
+    // in, so endSweep() only has the last sextants left. Sextants are split
+    // by azimuth instead of by point count, otherwise the selection is the
+    // same as for whole sweeps. Do not call extract*() within a sweep.
+    void beginSweep();
+    void addSegment(const pcl::PointCloud<PointType> &segment);
+    void endSweep(LaserFeatures &features);
+
+    Options options;
+
+  private:
+    // features and scratch memory of one scan line
+    struct ScanFeatures
+    {
+        pcl::PointCloud<PointType> cornerPointsSharp;
+        pcl::PointCloud<PointType> cornerPointsLessSharp;
+        pcl::PointCloud<PointType> surfPointsFlat;
+        pcl::PointCloud<PointType> surfPointsLessFlatScanDS;
+        ScanLineDownsampler downSizeFilter;
+        ScanLineDownsampler groundDownSizeFilter;
+        std::vector<int> candidates;
+        double timeSelectQ = 0;
+    };
+
+    int computeScanID(const pcl::PointXYZ &point) const;
+    void extractByAngle(const pcl::PointCloud<pcl::PointXYZ> &laserCloudIn,
+                        LaserFeatures &features, TicToc &t_prepare);
+    void extractFromTagged(const pcl::PointCloud<PointType> &laserCloudTagged,
+                           LaserFeatures &features, TicToc &t_prepare);
+    void markNeighborPicked(const pcl::PointCloud<PointType> &laserCloud, int ind);
+    void labelGround(const pcl::PointCloud<PointType> &laserCloud, const RangeImage &rangeImage, int i, int sp, int ep);
+    void extractScan(const pcl::PointCloud<PointType> &laserCloud, const RangeImage &rangeImage, int i);
+    void extractSextant(const pcl::PointCloud<PointType> &laserCloud, ScanFeatures &scan, int sp, int ep);
+    void beginScanFilters(ScanFeatures &scan);
+    void endScanFilters(ScanFeatures &scan);
+    void forEachScan(const std::function<void(int)> &body);
+    void mergeScans(LaserFeatures &features);
+
+    // progress of one scan line of a streamed sweep, boundary[j] is the
+    // first point of sextant j or -1 while none arrived
+    struct StreamScan
+    {
+        int count = 0;
+        int sextant = 0;
+        int nextSextant = 0;
+        int nextStart = 5;
+        int boundary[6];
+    };
+    void processStreamScan(int i, bool sweepEnded);
+
+    pcl::PointCloud<PointType> laserCloudTagged;
+    std::vector<int> rowCursor;
+    std::vector<int> scanStartInd;
+    std::vector<int> scanEndInd;
+
+    // structure of arrays copy of the ordered cloud for the curvature kernels
+    std::vector<float> cloudX;
+    std::vector<float> cloudY;
+    std::vector<float> cloudZ;
+
+    std::vector<float> cloudCurvature;
+    std::vector<int> cloudNeighborPicked;
+    std::vector<int> cloudLabel;
+    std::vector<char> cloudGround;
+
+    std::vector<ScanFeatures> scanFeatures;
+
+    // rows of a streamed sweep, row i starts at i * rowCapacity
+    int rowCapacity = 0;
+    pcl::PointCloud<PointType> streamCloud;
+    // cells of the streamed points that arrived so far, for the ground labels
+    RangeImage streamImage;
+    std::vector<StreamScan> streamScans;
+
+    ThreadPool *threadPool = nullptr;
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded queue of frames between one callback and one processing thread,
+// without a lock. push() is called by the callback only, empty(), front()
+// and pop() by the processing thread only. When the queue is full push()
+// drops the oldest frame, so a stalled thread keeps the newest capacity
+// frames instead of growing the queue, and counts the frame in dropped().
+//
+// The callback drops a frame by popping it, so the queue has two readers:
+// every slot carries a sequence number (Vyukov's bounded queue), the
+// readers claim a frame with a compare and swap of the read position and
+// the slot is written again only after the reader that claimed it released
+// it. front() moves the next frame into a slot of the processing thread, so
+// the frame it returns is never dropped under it.
+template <typename T>
+class FrameQueue
+{
+  public:
+    explicit FrameQueue(size_t capacity = 1)
+    {
+        setCapacity(capacity);
+    }
+
+    FrameQueue(const FrameQueue &) = delete;
+    FrameQueue &operator=(const FrameQueue &) = delete;
+
+    // call before the first push
+    void setCapacity(size_t capacity)
+    {
+        slots = std::vector<Slot>(capacity > 0 ? capacity : 1);
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        writePos.store(0, std::memory_order_relaxed);
+        readPos.store(0, std::memory_order_relaxed);
+        droppedFrames.store(0, std::memory_order_relaxed);
+        hasHead = false;
+        head = T();
+    }
+
+    size_t capacity() const
+    {
+        return slots.size();
+    }
+
+    // false if the oldest frame was dropped for this one
+    bool push(const T &frame)
+    {
+        bool dropped = false;
+        while (!tryPush(frame))
+        {
+            // full, unless the processing thread is still copying a frame it claimed
+            T oldest;
+            if (writePos.load(std::memory_order_relaxed) - readPos.load(std::memory_order_acquire) >= slots.size() &&
+                tryPop(oldest))
+            {
+                droppedFrames.fetch_add(1, std::memory_order_relaxed);
+                dropped = true;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+        return !dropped;
+    }
+
+    // frames dropped by push() so far
+    uint64_t dropped() const
+    {
+        return droppedFrames.load(std::memory_order_relaxed);
+    }
+
+    bool empty()
+    {
+        return !fetchHead();
+    }
+
+    // the oldest frame, the queue must not be empty
+    const T &front()
+    {
+        fetchHead();
+        return head;
+    }
+
+    void pop()
+    {
+        if (!fetchHead())
+            return;
+        head = T();
+        hasHead = false;
+    }
+
+  private:
+    struct Slot
+    {
+        Slot() : sequence(0) {}
+
+        std::atomic<size_t> sequence;
+        T frame;
+    };
+
+    // a slot at position pos holds sequence pos while free to write and
+    // pos + 1 while it holds a frame to read
+    bool tryPush(const T &frame)
+    {
+        size_t pos = writePos.load(std::memory_order_relaxed);
+        Slot &slot = slots[pos % slots.size()];
+        if (slot.sequence.load(std::memory_order_acquire) != pos)
+            return false;
+        slot.frame = frame;
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        writePos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &frame)
+    {
+        size_t pos = readPos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot &slot = slots[pos % slots.size()];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == pos + 1)
+            {
+                if (readPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    frame = std::move(slot.frame);
+                    slot.sequence.store(pos + slots.size(), std::memory_order_release);
+                    return true;
+                }
+                // pos now holds the position of the other reader
+            }
+            else if (sequence < pos + 1)
+            {
+                return false;
+            }
+            else
+            {
+                pos = readPos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool fetchHead()
+    {
+        if (!hasHead)
+            hasHead = tryPop(head);
+        return hasHead;
+    }
+
+    std::vector<Slot> slots;
+    std::atomic<size_t> writePos{0};
+    std::atomic<size_t> readPos{0};
+    std::atomic<uint64_t> droppedFrames{0};
+
+    // next frame, owned by the processing thread
+    bool hasHead = false;
+    T head;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/StdVector>
+#include <pcl/point_cloud.h>
+
+#include "aloam_velodyne/common.h"
+
+// Buffer of gyro samples that integrates the rotation of the lidar between
+// two times. The rate of a sample holds until the next one, past the newest
+// sample the newest rate is extrapolated. Samples may be added from another
+// thread than the one querying.
+class ImuIntegrator
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    typedef std::vector<Eigen::Quaterniond, Eigen::aligned_allocator<Eigen::Quaterniond>> Rotations;
+
+    // q_lidar_imu rotates vectors of the imu frame into the lidar frame,
+    // samples older than bufferTime seconds behind the newest are dropped
+    explicit ImuIntegrator(const Eigen::Quaterniond &q_lidar_imu, double bufferTime = 1.0);
+
+    void addSample(double time, const Eigen::Vector3d &angularVelocity);
+
+    // rotations[k] takes points of the lidar frame at t0 + k * dt into the
+    // frame at t0, for k in [0, count). False if the samples do not reach
+    // back to t0.
+    bool rotations(double t0, double dt, int count, Rotations &rotations);
+
+    // rotation that takes points of the lidar frame at t1 into the frame at t0
+    bool rotation(double t0, double t1, Eigen::Quaterniond &q);
+
+  private:
+    struct Sample
+    {
+        double time;
+        Eigen::Vector3d angularVelocity;
+    };
+
+    Eigen::Quaterniond q_lidar_imu;
+    double bufferTime;
+    std::deque<Sample> samples;
+    std::mutex mSamples;
+};
+
+// Moves every point into the lidar frame at the start of its sweep. knots
+// come from ImuIntegrator::rotations() over one scanPeriod, the rotation of
+// a point is interpolated between the knots around its relTime.
+void deskewCloud(pcl::PointCloud<PointType> &cloud, const ImuIntegrator::Rotations &knots, double scanPeriod);
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <nav_msgs/Odometry.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <ros/ros.h>
+#include <tf/transform_broadcaster.h>
+
+#include "aloam_velodyne/common.h"
+#include "aloam_velodyne/frame_queue.h"
+#include "aloam_velodyne/path_publisher.h"
+#include "aloam_velodyne/scan_matching.h"
+#include "aloam_velodyne/thread_pool.h"
+
+class LidarBatchFactor;
+
+// Scan to map stage. Registers the clouds from laserOdometry against a cube
+// map around the vehicle and publishes the refined pose and the map.
+// Callbacks only queue the input, a thread owned by the instance does the
+// mapping whenever a frame is complete until the instance is destroyed. With
+// a shared pool the mapping runs as a task on the pool whenever input arrives
+// instead, the callbacks must have stopped before the instance is destroyed
+// then.
+class LaserMapping
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    LaserMapping(ros::NodeHandle &nh, const std::string &droneName, ThreadPool *sharedPool = nullptr);
+    ~LaserMapping();
+
+    LaserMapping(const LaserMapping &) = delete;
+    LaserMapping &operator=(const LaserMapping &) = delete;
+
+  private:
+    static constexpr int laserCloudWidth = 21;
+    static constexpr int laserCloudHeight = 21;
+    static constexpr int laserCloudDepth = 11;
+    static constexpr int laserCloudNum = laserCloudWidth * laserCloudHeight * laserCloudDepth; //4851
+
+    void transformAssociateToMap();
+    void transformUpdate();
+    void pointAssociateToMap(PointType const *const pi, PointType *const po);
+    void pointAssociateTobeMapped(PointType const *const pi, PointType *const po);
+
+    void laserCloudCornerLastHandler(const pcl::PointCloud<PointType>::ConstPtr &laserCloudCornerLast2);
+    void laserCloudSurfLastHandler(const pcl::PointCloud<PointType>::ConstPtr &laserCloudSurfLast2);
+    void laserCloudFullResHandler(const pcl::PointCloud<PointType>::ConstPtr &laserCloudFullRes2);
+    void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr &laserOdometry);
+    bool frameQueued();
+    void wakeProcess();
+    void processAvailable();
+    void process();
+
+    std::string droneName;
+
+    int frameCount = 0;
+
+    double timeLaserCloudCornerLast = 0;
+    double timeLaserCloudSurfLast = 0;
+    double timeLaserCloudFullRes = 0;
+    double timeLaserOdometry = 0;
+
+    int laserCloudCenWidth = 10;
+    int laserCloudCenHeight = 10;
+    int laserCloudCenDepth = 5;
+
+    int laserCloudValidInd[125];
+    int laserCloudSurroundInd[125];
+
+    // input: from odom, shared with the publisher and only read here
+    pcl::PointCloud<PointType>::ConstPtr laserCloudCornerLast{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr laserCloudSurfLast{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr laserCloudFullRes{new pcl::PointCloud<PointType>()};
+
+    // surround points in map to build tree
+    pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap{new pcl::PointCloud<PointType>()};
+
+    // points in every cube
+    pcl::PointCloud<PointType>::Ptr laserCloudCornerArray[laserCloudNum];
+    pcl::PointCloud<PointType>::Ptr laserCloudSurfArray[laserCloudNum];
+
+    //kd-tree
+    pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap{new pcl::KdTreeFLANN<PointType>()};
+    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap{new pcl::KdTreeFLANN<PointType>()};
+
+    double parameters[7] = {0, 0, 0, 1, 0, 0, 0};
+    Eigen::Map<Eigen::Quaterniond> q_w_curr{parameters};
+    Eigen::Map<Eigen::Vector3d> t_w_curr{parameters + 4};
+
+    // wmap_T_odom * odom_T_curr = wmap_T_curr;
+    // transformation between odom's world and map's world frame
+    Eigen::Quaterniond q_wmap_wodom = Eigen::Quaterniond(1, 0, 0, 0);
+    Eigen::Vector3d t_wmap_wodom = Eigen::Vector3d(0, 0, 0);
+
+    Eigen::Quaterniond q_wodom_curr = Eigen::Quaterniond(1, 0, 0, 0);
+    Eigen::Vector3d t_wodom_curr = Eigen::Vector3d(0, 0, 0);
+
+    // filled by the callbacks, emptied by the mapping, frame_queue_size each
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> cornerLastBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> surfLastBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> fullResBuf;
+    FrameQueue<nav_msgs::Odometry::ConstPtr> odometryBuf;
+    // only for the wakeups of the thread of the instance, the queues need no lock
+    std::mutex mBuf;
+    std::condition_variable cvBuf;
+
+    pcl::VoxelGrid<PointType> downSizeFilterCorner;
+    pcl::VoxelGrid<PointType> downSizeFilterSurf;
+
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+
+    PointType pointOri, pointSel;
+
+    ros::Subscriber subLaserCloudCornerLast, subLaserCloudSurfLast, subLaserOdometry, subLaserCloudFullRes;
+    ros::Publisher pubLaserCloudSurround, pubLaserCloudMap, pubLaserCloudFullRes, pubOdomAftMapped, pubOdomAftMappedHighFrec;
+
+    PathPublisher laserAfterMappedPath;
+
+    tf::TransformBroadcaster br;
+
+    ScanMatchingBackend scanMatchingBackend = ScanMatchingBackend::AutoDiff;
+    // terms of the gauss_newton backend, reused for every registration
+    std::unique_ptr<LidarBatchFactor> gaussNewtonTerms;
+
+    std::atomic<bool> running{true};
+    std::thread mapping_process;
+    std::unique_ptr<PoolTask> mappingTask;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <geometry_msgs/QuaternionStamped.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <ros/ros.h>
+
+#include "aloam_velodyne/FeatureBundle.h"
+#include "aloam_velodyne/common.h"
+#include "aloam_velodyne/frame_queue.h"
+#include "aloam_velodyne/motion_predictor.h"
+#include "aloam_velodyne/path_publisher.h"
+#include "aloam_velodyne/projective_index.h"
+#include "aloam_velodyne/scan_matching.h"
+#include "aloam_velodyne/sweep_motion.h"
+#include "aloam_velodyne/thread_pool.h"
+
+class LidarBatchFactor;
+
+// Scan to scan odometry stage. Matches the features of every sweep against
+// the previous one and publishes the pose and the clouds for laserMapping.
+// Callbacks only queue the clouds and wake a thread owned by the instance,
+// which does the matching as soon as a sweep is complete, until the instance
+// is destroyed. With a shared pool the matching runs as a task on the pool
+// whenever input arrives instead, the callbacks must have stopped before the
+// instance is destroyed then.
+class LaserOdometry
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    LaserOdometry(ros::NodeHandle &nh, const std::string &droneName, ThreadPool *sharedPool = nullptr);
+    ~LaserOdometry();
+
+    LaserOdometry(const LaserOdometry &) = delete;
+    LaserOdometry &operator=(const LaserOdometry &) = delete;
+
+  private:
+    void TransformToStart(PointType const *const pi, PointType *const po);
+    pcl::PointCloud<PointType>::Ptr transformCloudToEnd(const pcl::PointCloud<PointType> &cloud);
+
+    void laserCloudSharpHandler(const pcl::PointCloud<PointType>::ConstPtr &cornerPointsSharp2);
+    void laserCloudLessSharpHandler(const pcl::PointCloud<PointType>::ConstPtr &cornerPointsLessSharp2);
+    void laserCloudFlatHandler(const pcl::PointCloud<PointType>::ConstPtr &surfPointsFlat2);
+    void laserCloudLessFlatHandler(const pcl::PointCloud<PointType>::ConstPtr &surfPointsLessFlat2);
+    void laserCloudFullResHandler(const pcl::PointCloud<PointType>::ConstPtr &laserCloudFullRes2);
+    void featureBundleHandler(const aloam_velodyne::FeatureBundleConstPtr &featureBundle);
+    void imuRotationHandler(const geometry_msgs::QuaternionStampedConstPtr &imuRotation);
+
+    bool sweepQueued();
+    bool fetchFeatureClouds();
+    bool fetchFeatureBundle();
+    bool fetchImuRotation(double time, Eigen::Quaterniond &q);
+    void findCornerCorrespondence(int i, int &closestPointInd, int &minPointInd2);
+    void findPlaneCorrespondence(int i, int &closestPointInd, int &minPointInd2, int &minPointInd3);
+    void forEachFeature(int num, const std::function<void(int)> &body);
+    void wakeProcess();
+    bool processFrame();
+    void process();
+
+    std::string droneName;
+
+    int corner_correspondence = 0, plane_correspondence = 0;
+
+    int skipFrameNum = 5;
+    bool systemInited = false;
+    int frameCount = 0;
+
+    double timeCornerPointsSharp = 0;
+    double timeCornerPointsLessSharp = 0;
+    double timeSurfPointsFlat = 0;
+    double timeSurfPointsLessFlat = 0;
+    double timeLaserCloudFullRes = 0;
+
+    pcl::KdTreeFLANN<pcl::PointXYZI>::Ptr kdtreeCornerLast{new pcl::KdTreeFLANN<pcl::PointXYZI>()};
+    pcl::KdTreeFLANN<pcl::PointXYZI>::Ptr kdtreeSurfLast{new pcl::KdTreeFLANN<pcl::PointXYZI>()};
+
+    // find the correspondences by scan line and azimuth instead of the kd trees,
+    // which are then not built
+    bool PROJECTIVE_ASSOCIATION = false;
+    ProjectiveIndex projectiveCornerLast;
+    ProjectiveIndex projectiveSurfLast;
+
+    // the received clouds are shared with the publisher and the other
+    // subscribers, they are only read here
+    pcl::PointCloud<PointType>::ConstPtr cornerPointsSharp{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr cornerPointsLessSharp{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr surfPointsFlat{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr surfPointsLessFlat{new pcl::PointCloud<PointType>()};
+
+    pcl::PointCloud<PointType>::ConstPtr laserCloudCornerLast{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr laserCloudSurfLast{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::ConstPtr laserCloudFullRes{new pcl::PointCloud<PointType>()};
+
+    int laserCloudCornerLastNum = 0;
+    int laserCloudSurfLastNum = 0;
+
+    // points of the last sweep a feature is matched to, by feature index,
+    // -1 where there is none
+    struct Correspondence
+    {
+        int a, b, c;
+    };
+    std::vector<Correspondence> cornerCorrespondences;
+    std::vector<Correspondence> surfCorrespondences;
+
+    // Transformation from current frame to world frame
+    Eigen::Quaterniond q_w_curr = Eigen::Quaterniond(1, 0, 0, 0);
+    Eigen::Vector3d t_w_curr = Eigen::Vector3d(0, 0, 0);
+
+    // q_curr_last(x, y, z, w), t_curr_last
+    double para_q[4] = {0, 0, 0, 1};
+    double para_t[3] = {0, 0, 0};
+
+    Eigen::Map<Eigen::Quaterniond> q_last_curr{para_q};
+    Eigen::Map<Eigen::Vector3d> t_last_curr{para_t};
+
+    // motion of the current sweep the features are moved by
+    bool DISTORTION = false;
+    SweepMotion sweepMotion;
+
+    // the motion every registration starts from and when it may stop
+    MotionPredictor motionPredictor;
+    PoseTolerance convergenceTolerance;
+
+    // filled by the callbacks, emptied by the matching, frame_queue_size each
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> cornerSharpBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> cornerLessSharpBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> surfFlatBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> surfLessFlatBuf;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> fullPointsBuf;
+    FrameQueue<aloam_velodyne::FeatureBundleConstPtr> featureBundleBuf;
+    // only for the wakeups of the thread of the instance, the queues need no lock
+    std::mutex mBuf;
+    std::condition_variable cvBuf;
+
+    // take the features from the single bundle topic instead of the five clouds
+    bool USE_FEATURE_BUNDLE = false;
+    pcl::PointCloud<PointType> laserCloudBundle;
+
+    ScanMatchingBackend scanMatchingBackend = ScanMatchingBackend::AutoDiff;
+    // terms of the gauss_newton backend, reused for every registration
+    std::unique_ptr<LidarBatchFactor> gaussNewtonTerms;
+
+    // start the rotation of every sweep from the one the imu measured
+    bool USE_IMU = false;
+    FrameQueue<geometry_msgs::QuaternionStampedConstPtr> imuRotationBuf;
+
+    ros::Subscriber subImuRotation;
+    ros::Subscriber subFeatureBundle, subCornerPointsSharp, subCornerPointsLessSharp, subSurfPointsFlat,
+        subSurfPointsLessFlat, subLaserCloudFullRes;
+    ros::Publisher pubLaserCloudCornerLast, pubLaserCloudSurfLast, pubLaserCloudFullRes, pubLaserOdometry;
+
+    PathPublisher laserPath;
+
+    std::atomic<bool> running{true};
+    std::thread odometryThread;
+    std::unique_ptr<PoolTask> odometryTask;
+
+    // pool the correspondences are searched on, null to search serially
+    std::unique_ptr<ThreadPool> threadPool;
+    ThreadPool *associationPool = nullptr;
+};
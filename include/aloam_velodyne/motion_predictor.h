@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+
+#include <eigen3/Eigen/Dense>
+
+// Predicts the motion between two sweeps from the registered motions before,
+// to start the registration of a sweep from. A motion q, t takes points of
+// the later sweep into the frame of the earlier one, like q_last_curr and
+// t_last_curr of laserOdometry. It is kept as a twist, the rotation vector
+// and the translation per second, so sweeps that come late or are dropped
+// get a motion for their own time span.
+//   ConstantVelocity     : the twist of the last motion
+//   ConstantAcceleration : the twist of the last motion changed at the rate
+//                          between the last two motions
+// The covariance of a prediction, rotation first, is the one of the errors
+// of the predictions before against the registered motions, averaged
+// exponentially over the sweeps.
+class MotionPredictor
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    typedef Eigen::Matrix<double, 6, 1> Vector6d;
+    typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+    enum class Model
+    {
+        ConstantVelocity,
+        ConstantAcceleration
+    };
+
+    // accepts "constant_velocity" and "constant_acceleration"
+    static bool parseModel(const std::string &name, Model &model);
+
+    explicit MotionPredictor(Model model = Model::ConstantVelocity);
+
+    // forget the motions, the next one starts at the sweep at time
+    void reset(double time);
+
+    // motion from the last sweep to the sweep at time, false while there is
+    // no motion to predict from
+    bool predict(double time, Eigen::Quaterniond &q, Eigen::Vector3d &t, Matrix6d &covariance) const;
+
+    // the registered motion from the last sweep to the sweep at time
+    void update(double time, const Eigen::Quaterniond &q, const Eigen::Vector3d &t);
+
+  private:
+    Vector6d predictTwist(double dtNext) const;
+
+    Model model;
+    bool started;
+    double lastTime;
+
+    // twists of the last two motions and the time spans they cover
+    int numMotions;
+    Vector6d twist, lastTwist;
+    double dt, lastDt;
+
+    Matrix6d errorCovariance;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <geometry_msgs/PoseStamped.h>
+#include <nav_msgs/Path.h>
+#include <ros/ros.h>
+
+// Publishes a trajectory at a cost that does not grow with its length. The
+// path keeps one of every decimation poses in a ring of maxLength poses and
+// is published whenever it keeps one, so it shows the recent trajectory.
+// Every pose also goes out alone on the pose topic, for consumers that keep
+// the whole history themselves.
+class PathPublisher
+{
+  public:
+    void advertise(ros::NodeHandle &nh, const std::string &pathTopic, const std::string &poseTopic,
+                   int maxLength, int decimation);
+
+    void publish(const geometry_msgs::PoseStamped &pose);
+
+  private:
+    ros::Publisher pubPath;
+    ros::Publisher pubPose;
+
+    int decimation = 1;
+    int poseCount = 0;
+
+    // the oldest pose is at ringStart once the ring is full
+    std::vector<geometry_msgs::PoseStamped> ring;
+    size_t maxLength = 1;
+    size_t ringStart = 0;
+
+    nav_msgs::Path path;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+#include "aloam_velodyne/common.h"
+
+// Index of the features of a sweep by scan line and azimuth, for the
+// projective association of laserOdometry. Every scan line is cut into
+// azimuth bins and the points of a cell lie next to each other in one array,
+// sorted in by counting, so building the index is linear in the cloud. A
+// query projects the point into the cells and only looks at the few bins
+// around it on the asked scan lines, instead of searching a tree and walking
+// along the scan lines. The scan line is the integer part of the intensity.
+// The arrays are kept between sweeps. Queries do not change the index, so
+// they may run in parallel.
+class ProjectiveIndex
+{
+  public:
+    ProjectiveIndex();
+
+    // azimuthBins bins per scan line, a query looks searchBins bins to each side
+    void setResolution(int azimuthBins, int searchBins);
+
+    void setInputCloud(const pcl::PointCloud<PointType>::ConstPtr &cloud);
+
+    // Nearest point to point on the scan lines firstScan to lastScan, leaving
+    // out the points on skipScan and the point skipIndex, -1 for none of them.
+    // Returns -1 if no point is closer than sqrt(maxSqDis).
+    int nearest(const PointType &point, int firstScan, int lastScan, int skipScan, int skipIndex,
+                double maxSqDis) const;
+
+  private:
+    int azimuthBin(const PointType &point) const;
+
+    int azimuthBins;
+    int searchBins;
+    int nScans;
+
+    pcl::PointCloud<PointType>::ConstPtr cloud;
+
+    // points of cell scan * azimuthBins + bin are cellPoints[cellStart[cell]] up to
+    // cellPoints[cellStart[cell + 1]]
+    std::vector<int> cellStart;
+    std::vector<int> cellPoints;
+    std::vector<int> pointCell;
+    std::vector<int> cellFill;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// Index of an ordered sweep as a range image, rows are scan lines and
+// columns are azimuth bins. The points themselves stay in the ordered cloud,
+// row r is the index range [rowBegin(r), rowEnd(r)) of it, and every cell
+// holds the index of the first point that fell into it or -1. The buffers
+// keep their size between sweeps of the same geometry.
+struct RangeImage
+{
+    int rows = 0;
+    int cols = 0;
+    std::vector<int> rowStart;
+    std::vector<int> cells;
+
+    void reset(int rows_, int cols_)
+    {
+        rows = rows_;
+        cols = cols_;
+        rowStart.assign(rows + 1, 0);
+        cells.assign(rows * cols, -1);
+    }
+
+    int rowBegin(int row) const
+    {
+        return rowStart[row];
+    }
+
+    int rowEnd(int row) const
+    {
+        return rowStart[row + 1];
+    }
+
+    // index of the point in cell (row, col) of the ordered cloud, or -1
+    int at(int row, int col) const
+    {
+        return cells[row * cols + col];
+    }
+
+    // column of a point from the fraction of the sweep it was captured at
+    int colOf(float relTime) const
+    {
+        int col = int(relTime * cols);
+        return std::min(std::max(col, 0), cols - 1);
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+#include "aloam_velodyne/common.h"
+
+// Voxel grid filter for the points of a single scan line. It gives the same
+// voxels and centroids as pcl::VoxelGrid, but writes them in the order they
+// are first hit along the scan. Points of a scan line come ordered by
+// azimuth, so most points fall into the voxel of the point before and skip
+// the hash lookup. The hash table and voxel buffers are kept between scan
+// lines, so after the first sweeps the filter does not allocate.
+class ScanLineDownsampler
+{
+  public:
+    ScanLineDownsampler();
+
+    void setLeafSize(float leafSize);
+
+    // start a new scan line
+    void begin();
+
+    void add(const PointType &point);
+
+    // append one centroid per occupied voxel to out
+    void end(pcl::PointCloud<PointType> &out);
+
+  private:
+    struct Voxel
+    {
+        std::uint64_t key;
+        double sumX, sumY, sumZ, sumIntensity;
+        int count;
+    };
+
+    std::uint64_t voxelKey(const PointType &point) const;
+    int findOrInsert(std::uint64_t key);
+    void rehash(size_t capacity);
+
+    float inverseLeafSize;
+
+    // open addressing table of voxel indices, a slot is empty when its
+    // stamp is not the stamp of the current scan line
+    std::vector<int> table;
+    std::vector<std::uint32_t> tableStamp;
+    std::uint32_t stamp;
+
+    std::vector<Voxel> voxels;
+    int lastVoxel;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+
+// Cost functions laserOdometry and laserMapping register the features with.
+//   AutoDiff    : ceres::AutoDiffCostFunction factors
+//   Analytic    : the same residuals with hand derived jacobians for a
+//                 rotation update on the right, q * Exp(delta)
+//   Batched     : the analytic residuals of a frame in one cost function
+//                 with the Huber loss applied inside, one residual block
+//   GaussNewton : the batched residuals solved without ceres, Gauss-Newton
+//                 on the 6 dof pose with the normal equations summed directly
+enum class ScanMatchingBackend
+{
+    AutoDiff,
+    Analytic,
+    Batched,
+    GaussNewton
+};
+
+// accepts "autodiff", "analytic", "batched" and "gauss_newton"
+inline bool parseScanMatchingBackend(const std::string &name, ScanMatchingBackend &backend)
+{
+    if (name == "autodiff")
+        backend = ScanMatchingBackend::AutoDiff;
+    else if (name == "analytic")
+        backend = ScanMatchingBackend::Analytic;
+    else if (name == "batched")
+        backend = ScanMatchingBackend::Batched;
+    else if (name == "gauss_newton")
+        backend = ScanMatchingBackend::GaussNewton;
+    else
+        return false;
+    return true;
+}
+
+inline const char *scanMatchingBackendName(ScanMatchingBackend backend)
+{
+    switch (backend)
+    {
+    case ScanMatchingBackend::AutoDiff:
+        return "autodiff";
+    case ScanMatchingBackend::Analytic:
+        return "analytic";
+    case ScanMatchingBackend::Batched:
+        return "batched";
+    case ScanMatchingBackend::GaussNewton:
+        return "gauss_newton";
+    }
+    return "unknown";
+}
+
+// A registration has converged once a step of the pose rotates by less than
+// rotation radians and moves by less than translation meters. The default
+// of zero never converges early.
+struct PoseTolerance
+{
+    double rotation = 0;
+    double translation = 0;
+
+    bool reached(double angle, double distance) const
+    {
+        return angle < rotation && distance < translation;
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nav_msgs/Odometry.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <ros/ros.h>
+#include <sensor_msgs/Imu.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include "aloam_velodyne/common.h"
+#include "aloam_velodyne/feature_budget.h"
+#include "aloam_velodyne/feature_extractor.h"
+#include "aloam_velodyne/imu_integrator.h"
+#include "aloam_velodyne/thread_pool.h"
+
+// Feature extraction stage. Subscribes to the driver cloud and publishes the
+// feature clouds of every sweep for laserOdometry. Topics and frames are
+// prefixed with droneName. All state is owned by the instance, so it runs
+// as a node as well as a nodelet. A shared pool, if given, is used instead of
+// scan_registration_threads to extract the scan lines in parallel.
+class ScanRegistration
+{
+  public:
+    ScanRegistration(ros::NodeHandle &nh, const std::string &droneName, ThreadPool *sharedPool = nullptr);
+
+    ScanRegistration(const ScanRegistration &) = delete;
+    ScanRegistration &operator=(const ScanRegistration &) = delete;
+
+    // false if the parameters ask for a sensor that is not supported,
+    // nothing is subscribed then
+    bool ok() const
+    {
+        return initialized;
+    }
+
+  private:
+    void publishCloud(const ros::Publisher &pub, const pcl::PointCloud<PointType> &cloud, const ros::Time &stamp);
+    void publishFeatures(const ros::Time &stamp);
+    bool systemReady();
+    void laserCloudHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg);
+    void finishSweep();
+    void laserSegmentHandler(const sensor_msgs::PointCloud2ConstPtr &laserSegmentMsg);
+    void imuHandler(const sensor_msgs::ImuConstPtr &imuMsg);
+    void applyImu(const ros::Time &stamp);
+    void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr &laserOdometry);
+    void applyBudget();
+    void publishDiagnostics();
+
+    std::string droneName;
+    bool initialized = false;
+
+    int systemInitCount = 0;
+    bool systemInited = false;
+    int N_SCANS = 0;
+
+    std::unique_ptr<ThreadPool> threadPool;
+    std::unique_ptr<FeatureExtractor> featureExtractor;
+    LaserFeatures laserFeatures;
+
+    ros::Subscriber subLaserCloud;
+    ros::Subscriber subImu;
+    ros::Subscriber subLaserOdometry;
+    ros::Publisher pubLaserCloud;
+    ros::Publisher pubCornerPointsSharp;
+    ros::Publisher pubCornerPointsLessSharp;
+    ros::Publisher pubSurfPointsFlat;
+    ros::Publisher pubSurfPointsLessFlat;
+    ros::Publisher pubRemovePoints;
+    ros::Publisher pubFeatureBundle;
+    ros::Publisher pubImuRotation;
+    ros::Publisher pubDiagnostics;
+    std::vector<ros::Publisher> pubEachScan;
+
+    bool PUB_EACH_LINE = false;
+
+    // publish all features of a sweep as one aloam_velodyne::FeatureBundle
+    bool PUBLISH_FEATURE_BUNDLE = false;
+    pcl::PointCloud<PointType> laserCloudBundle;
+
+    double MINIMUM_RANGE = 0.1;
+
+    // take scan line and time from the ring and time fields of the driver
+    bool USE_RING_TIME_FIELDS = false;
+    std::string RING_FIELD = "ring";
+    std::string TIME_FIELD = "t";
+
+    // with more than one segment per sweep, every message is a part of the sweep
+    // and the features are extracted while the sweep comes in
+    int SWEEP_SEGMENTS = 1;
+    double TIME_FIELD_SCALE = 1e-9;
+    // the time field counts from the start of the sweep, like the t field of
+    // the Ouster driver, instead of from the stamp of each segment
+    bool TIME_FIELD_FROM_SWEEP_START = true;
+    bool sweepOpen = false;
+    double sweepStart = 0;
+    ros::Time sweepStamp;
+    int sweepSegmentCount = 0;
+
+    // deskew the features with the gyro of an imu and send the rotation
+    // between sweeps to laserOdometry as its initial guess
+    bool USE_IMU = false;
+    std::unique_ptr<ImuIntegrator> imuIntegrator;
+    ImuIntegrator::Rotations deskewKnots;
+    bool hasLastSweep = false;
+    double lastSweepTime = 0;
+
+    // adapt the feature budget so that the latency from the arrival of a
+    // sweep to its odometry stays at a target
+    std::unique_ptr<FeatureBudgetController> budgetController;
+    std::chrono::steady_clock::time_point sweepArrival;
+    std::deque<std::pair<double, std::chrono::steady_clock::time_point>> sweepArrivals;
+    int budgetSweepCount = 0;
+    std::mutex mBudget;
+
+    // decoded input clouds, kept between sweeps
+    pcl::PointCloud<PointType> laserCloudTagged;
+    pcl::PointCloud<pcl::PointXYZ> laserCloudIn;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/StdVector>
+#include <pcl/point_cloud.h>
+
+#include "aloam_velodyne/common.h"
+
+// Moves the points of a sweep by the motion of the lidar during the sweep.
+// The motion q, t takes points of the frame at the end of the sweep into the
+// frame at its start. With distortion, a point at the fraction s of the sweep,
+// s = relTime / scanPeriod, moves by the slerp of q to s and by s * t, like in
+// the factors; without it every point moves by q, t. The transforms are
+// computed at numSegments + 1 knots across the sweep and interpolated
+// linearly for every point, instead of a slerp per point, so whole clouds
+// are moved in one pass.
+class SweepMotion
+{
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    SweepMotion(double scanPeriod, int numSegments);
+
+    void set(const Eigen::Quaterniond &q, const Eigen::Vector3d &t, bool distortion);
+
+    // point in the frame at the start of the sweep
+    void toStart(const PointType &in, PointType &out) const;
+
+    // cloud in the frame at the end of the sweep, the intensity keeps only
+    // the scan line
+    void toEnd(const pcl::PointCloud<PointType> &in, pcl::PointCloud<PointType> &out) const;
+
+  private:
+    typedef Eigen::Matrix<float, 3, 4> Transform;
+    typedef std::vector<Transform, Eigen::aligned_allocator<Transform>> Transforms;
+
+    // knot and ratio to the next knot of a point
+    int knot(const PointType &point, float &ratio) const;
+
+    static void setSlopes(const Transforms &knots, Transforms &slopes);
+
+    float inverseScanPeriod;
+    int numSegments;
+    bool distortion;
+
+    // the transform at a knot and its change to the next knot
+    Transforms startKnots, startSlopes;
+    Transforms endKnots, endSlopes;
+};
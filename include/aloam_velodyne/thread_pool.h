@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads, shared by everything that wants to run
+// work in parallel inside one process.
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(int numThreads)
+    {
+        for (int i = 0; i < numThreads; i++)
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mTasks);
+            stopping = true;
+        }
+        cvTasks.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    void enqueue(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mTasks);
+            tasks.push(std::move(task));
+        }
+        cvTasks.notify_one();
+    }
+
+    // run body(i) for every i in [begin, end) and return when all are done.
+    // The calling thread takes part, so this never waits on a busy pool.
+    void parallelFor(int begin, int end, const std::function<void(int)> &body)
+    {
+        if (end <= begin)
+            return;
+
+        struct Job
+        {
+            std::atomic<int> next;
+            std::atomic<int> done;
+            int end;
+            const std::function<void(int)> *body;
+            std::mutex mDone;
+            std::condition_variable cvDone;
+        };
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->next = begin;
+        job->done = 0;
+        job->end = end;
+        job->body = &body;
+
+        const int total = end - begin;
+        auto run = [job, total]() {
+            int i;
+            while ((i = job->next.fetch_add(1)) < job->end)
+            {
+                (*job->body)(i);
+                if (job->done.fetch_add(1) + 1 == total)
+                {
+                    std::lock_guard<std::mutex> lock(job->mDone);
+                    job->cvDone.notify_all();
+                }
+            }
+        };
+
+        int helpers = std::min(size(), total - 1);
+        for (int i = 0; i < helpers; i++)
+            enqueue(run);
+        run();
+
+        std::unique_lock<std::mutex> lock(job->mDone);
+        job->cvDone.wait(lock, [&job, total]() { return job->done.load() == total; });
+    }
+
+  private:
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mTasks);
+                cvTasks.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mTasks;
+    std::condition_variable cvTasks;
+    bool stopping = false;
+};
+
+// Runs body on a pool whenever notify() is called, never twice at the same
+// time. Notifications that come in while body runs make it run once more,
+// so no input is left behind. The pool must outlive the task, destroying
+// the task waits for a pending run.
+class PoolTask
+{
+  public:
+    PoolTask(ThreadPool &pool, std::function<void()> body)
+        : pool(pool), body(std::move(body))
+    {
+    }
+
+    ~PoolTask()
+    {
+        std::unique_lock<std::mutex> lock(mIdle);
+        cvIdle.wait(lock, [this]() { return pending.load() == 0; });
+    }
+
+    PoolTask(const PoolTask &) = delete;
+    PoolTask &operator=(const PoolTask &) = delete;
+
+    void notify()
+    {
+        if (pending.fetch_add(1) == 0)
+            pool.enqueue([this]() { run(); });
+    }
+
+  private:
+    void run()
+    {
+        int seen = pending.load();
+        while (true)
+        {
+            body();
+
+            // the last access to the task happens under the lock, so the
+            // destructor cannot finish before it
+            std::lock_guard<std::mutex> lock(mIdle);
+            int left = pending.fetch_sub(seen) - seen;
+            if (left == 0)
+            {
+                cvIdle.notify_all();
+                return;
+            }
+            seen = left;
+        }
+    }
+
+    ThreadPool &pool;
+    std::function<void()> body;
+    std::atomic<int> pending{0};
+    std::mutex mIdle;
+    std::condition_variable cvIdle;
+};
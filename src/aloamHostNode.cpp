@@ -0,0 +1,73 @@
+// Hosts the pipelines of several drones in one process, e.g. to process the
+// logs of a fleet on a ground station. Every drone in the private parameter
+// drone_names gets its own scanRegistration, laserOdometry and laserMapping,
+// all of them share one worker pool, so the work is scheduled on a fixed
+// number of threads instead of three busy processes per drone. The clouds
+// between the stages of a drone are passed as pointers. The pipelines read
+// the same global parameters.
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>     /* getenv */
+#include <ros/ros.h>
+
+#include "aloam_velodyne/laser_mapping.h"
+#include "aloam_velodyne/laser_odometry.h"
+#include "aloam_velodyne/scan_registration.h"
+#include "aloam_velodyne/thread_pool.h"
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "aloamHost");
+    ros::NodeHandle nh;
+    ros::NodeHandle privateNh("~");
+
+    std::vector<std::string> droneNames;
+    if (!privateNh.getParam("drone_names", droneNames) || droneNames.empty())
+    {
+        const char *env = getenv("DRONE_NAME");
+        droneNames.assign(1, env ? env : "");
+    }
+
+    // the stages wait for their input most of the time, so by default the
+    // pool gets one thread per core and the callbacks one thread per drone
+    int workerThreads = 0;
+    int callbackThreads = 0;
+    privateNh.param<int>("worker_threads", workerThreads, 0);
+    privateNh.param<int>("callback_threads", callbackThreads, int(droneNames.size()));
+    if (workerThreads <= 0)
+        workerThreads = std::max(int(std::thread::hardware_concurrency()), 1);
+    printf("host %zu drones on %d worker threads and %d callback threads \n",
+           droneNames.size(), workerThreads, callbackThreads);
+
+    ThreadPool pool(workerThreads);
+    {
+        std::vector<std::unique_ptr<ScanRegistration>> scanRegistrations;
+        std::vector<std::unique_ptr<LaserOdometry>> laserOdometries;
+        std::vector<std::unique_ptr<LaserMapping>> laserMappings;
+        for (const std::string &droneName : droneNames)
+        {
+            printf("pipeline of drone %s \n", droneName.c_str());
+            scanRegistrations.emplace_back(new ScanRegistration(nh, droneName, &pool));
+            if (!scanRegistrations.back()->ok())
+            {
+                printf("scan registration parameters are not supported \n");
+                return 0;
+            }
+            laserOdometries.emplace_back(new LaserOdometry(nh, droneName, &pool));
+            laserMappings.emplace_back(new LaserMapping(nh, droneName, &pool));
+        }
+
+        ros::AsyncSpinner spinner(std::max(callbackThreads, 1));
+        spinner.start();
+        ros::waitForShutdown();
+
+        // no callback may reach the stages while they are destroyed
+        spinner.stop();
+    }
+
+    return 0;
+}
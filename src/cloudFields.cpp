@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "aloam_velodyne/cloud_fields.h"
+
+CloudField findCloudField(const sensor_msgs::PointCloud2 &msg, const std::string &name)
+{
+    CloudField field;
+    for (size_t i = 0; i < msg.fields.size(); i++)
+    {
+        if (msg.fields[i].name == name)
+        {
+            field.offset = msg.fields[i].offset;
+            field.datatype = msg.fields[i].datatype;
+            break;
+        }
+    }
+    return field;
+}
+
+template <typename T>
+static inline double readAs(const std::uint8_t *data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+double readCloudField(const std::uint8_t *data, const CloudField &field)
+{
+    const std::uint8_t *p = data + field.offset;
+    switch (field.datatype)
+    {
+    case sensor_msgs::PointField::INT8:
+        return readAs<std::int8_t>(p);
+    case sensor_msgs::PointField::UINT8:
+        return readAs<std::uint8_t>(p);
+    case sensor_msgs::PointField::INT16:
+        return readAs<std::int16_t>(p);
+    case sensor_msgs::PointField::UINT16:
+        return readAs<std::uint16_t>(p);
+    case sensor_msgs::PointField::INT32:
+        return readAs<std::int32_t>(p);
+    case sensor_msgs::PointField::UINT32:
+        return readAs<std::uint32_t>(p);
+    case sensor_msgs::PointField::FLOAT32:
+        return readAs<float>(p);
+    case sensor_msgs::PointField::FLOAT64:
+        return readAs<double>(p);
+    default:
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+static size_t cloudFieldSize(const CloudField &field)
+{
+    switch (field.datatype)
+    {
+    case sensor_msgs::PointField::INT8:
+    case sensor_msgs::PointField::UINT8:
+        return 1;
+    case sensor_msgs::PointField::INT16:
+    case sensor_msgs::PointField::UINT16:
+        return 2;
+    case sensor_msgs::PointField::INT32:
+    case sensor_msgs::PointField::UINT32:
+    case sensor_msgs::PointField::FLOAT32:
+        return 4;
+    case sensor_msgs::PointField::FLOAT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// x, y and z of one point, false for NaN points and points closer than the minimum range
+struct XYZReader
+{
+    const sensor_msgs::PointCloud2 &msg;
+    CloudField x, y, z;
+    bool packedFloat;
+    bool sizesValid;
+    float minimumRange2;
+
+    XYZReader(const sensor_msgs::PointCloud2 &msg, double minimumRange)
+        : msg(msg), x(findCloudField(msg, "x")), y(findCloudField(msg, "y")), z(findCloudField(msg, "z")),
+          minimumRange2(float(minimumRange) * float(minimumRange))
+    {
+        // the rows are read with point_step strides from row * row_step, so
+        // every row has to hold width points and data every row
+        sizesValid = size_t(msg.row_step) >= size_t(msg.width) * msg.point_step &&
+                     msg.data.size() >= size_t(msg.height) * msg.row_step;
+
+        // drivers publish float x y z next to each other, read them with one copy
+        packedFloat = x.datatype == sensor_msgs::PointField::FLOAT32 &&
+                      y.datatype == sensor_msgs::PointField::FLOAT32 &&
+                      z.datatype == sensor_msgs::PointField::FLOAT32 &&
+                      y.offset == x.offset + 4 && z.offset == x.offset + 8;
+    }
+
+    // true if the field lies inside a point
+    bool fits(const CloudField &field) const
+    {
+        return field.valid() && size_t(field.offset) + cloudFieldSize(field) <= msg.point_step;
+    }
+
+    // true if the cloud has x, y and z and the message holds all its points
+    bool valid() const
+    {
+        return sizesValid && fits(x) && fits(y) && fits(z);
+    }
+
+    template <typename PointT>
+    bool read(const std::uint8_t *data, PointT &point) const
+    {
+        if (packedFloat)
+        {
+            float xyz[3];
+            std::memcpy(xyz, data + x.offset, sizeof(xyz));
+            point.x = xyz[0];
+            point.y = xyz[1];
+            point.z = xyz[2];
+        }
+        else
+        {
+            point.x = readCloudField(data, x);
+            point.y = readCloudField(data, y);
+            point.z = readCloudField(data, z);
+        }
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+            return false;
+        return point.x * point.x + point.y * point.y + point.z * point.z >= minimumRange2;
+    }
+};
+
+bool decodeXYZCloud(const sensor_msgs::PointCloud2 &msg, double minimumRange,
+                    pcl::PointCloud<pcl::PointXYZ> &cloudOut)
+{
+    XYZReader reader(msg, minimumRange);
+    if (!reader.valid())
+        return false;
+
+    cloudOut.header.frame_id = msg.header.frame_id;
+    cloudOut.points.resize(size_t(msg.width) * msg.height);
+    size_t count = 0;
+    for (uint32_t row = 0; row < msg.height; row++)
+    {
+        const std::uint8_t *data = &msg.data[row * msg.row_step];
+        for (uint32_t col = 0; col < msg.width; col++, data += msg.point_step)
+        {
+            if (reader.read(data, cloudOut.points[count]))
+                count++;
+        }
+    }
+    cloudOut.points.resize(count);
+    cloudOut.height = 1;
+    cloudOut.width = count;
+    cloudOut.is_dense = true;
+    return true;
+}
+
+bool decodeRingTimeCloud(const sensor_msgs::PointCloud2 &msg, const std::string &ringField,
+                         const std::string &timeField, int nScans, double scanPeriod,
+                         double minimumRange, pcl::PointCloud<PointType> &cloudOut)
+{
+    XYZReader reader(msg, minimumRange);
+    CloudField fieldRing = findCloudField(msg, ringField);
+    CloudField fieldTime = findCloudField(msg, timeField);
+    if (!reader.valid() || !reader.fits(fieldRing) || !reader.fits(fieldTime))
+        return false;
+
+    cloudOut.clear();
+    cloudOut.header.frame_id = msg.header.frame_id;
+    const size_t numPoints = size_t(msg.width) * msg.height;
+    if (numPoints == 0)
+        return true;
+
+    // time span of the sweep, every column counts even if its return is invalid
+    double timeMin = std::numeric_limits<double>::max();
+    double timeMax = std::numeric_limits<double>::lowest();
+    for (uint32_t row = 0; row < msg.height; row++)
+    {
+        const std::uint8_t *data = &msg.data[row * msg.row_step];
+        for (uint32_t col = 0; col < msg.width; col++, data += msg.point_step)
+        {
+            double time = readCloudField(data, fieldTime);
+            timeMin = std::min(timeMin, time);
+            timeMax = std::max(timeMax, time);
+        }
+    }
+    double timeScale = timeMax > timeMin ? scanPeriod / (timeMax - timeMin) : 0;
+
+    cloudOut.reserve(numPoints);
+    PointType point;
+    for (uint32_t row = 0; row < msg.height; row++)
+    {
+        const std::uint8_t *data = &msg.data[row * msg.row_step];
+        for (uint32_t col = 0; col < msg.width; col++, data += msg.point_step)
+        {
+            if (!reader.read(data, point))
+                continue;
+
+            int ring = int(readCloudField(data, fieldRing));
+            if (ring < 0 || ring >= nScans)
+                continue;
+
+            // keep the fractional part below 1 so int(intensity) stays the ring
+            double relTime = (readCloudField(data, fieldTime) - timeMin) * timeScale;
+            point.intensity = ring + std::min(relTime, 0.9999);
+            cloudOut.push_back(point);
+        }
+    }
+    cloudOut.height = 1;
+    cloudOut.width = cloudOut.size();
+    cloudOut.is_dense = true;
+    return true;
+}
+
+bool decodeRingTimeSegment(const sensor_msgs::PointCloud2 &msg, const std::string &ringField,
+                           const std::string &timeField, double timeScale, double timeOrigin,
+                           int nScans, double scanPeriod, double minimumRange,
+                           pcl::PointCloud<PointType> &cloudOut)
+{
+    XYZReader reader(msg, minimumRange);
+    CloudField fieldRing = findCloudField(msg, ringField);
+    CloudField fieldTime = findCloudField(msg, timeField);
+    if (!reader.valid() || !reader.fits(fieldRing) || !reader.fits(fieldTime))
+        return false;
+
+    cloudOut.clear();
+    cloudOut.header.frame_id = msg.header.frame_id;
+    cloudOut.reserve(size_t(msg.width) * msg.height);
+    PointType point;
+    for (uint32_t row = 0; row < msg.height; row++)
+    {
+        const std::uint8_t *data = &msg.data[row * msg.row_step];
+        for (uint32_t col = 0; col < msg.width; col++, data += msg.point_step)
+        {
+            if (!reader.read(data, point))
+                continue;
+
+            int ring = int(readCloudField(data, fieldRing));
+            if (ring < 0 || ring >= nScans)
+                continue;
+
+            double relTime = (timeOrigin + readCloudField(data, fieldTime) * timeScale) / scanPeriod;
+            relTime = std::min(std::max(relTime, 0.0), 0.9999);
+            point.intensity = ring + scanPeriod * relTime;
+            cloudOut.push_back(point);
+        }
+    }
+    cloudOut.height = 1;
+    cloudOut.width = cloudOut.size();
+    cloudOut.is_dense = true;
+    return true;
+}
@@ -0,0 +1,199 @@
+#include "aloam_velodyne/curvature.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALOAM_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static inline float windowReference(const float *p)
+{
+    return p[-5] + p[-4] + p[-3] + p[-2] + p[-1] - 10 * p[0] + p[1] + p[2] + p[3] + p[4] + p[5];
+}
+
+static void curvatureReference(const float *x, const float *y, const float *z,
+                               int begin, int end, float *curvature)
+{
+    for (int i = begin; i < end; i++)
+    {
+        float diffX = windowReference(x + i);
+        float diffY = windowReference(y + i);
+        float diffZ = windowReference(z + i);
+        curvature[i] = diffX * diffX + diffY * diffY + diffZ * diffZ;
+    }
+}
+
+static void curvatureRunningSum(const float *x, const float *y, const float *z, int n, float *curvature)
+{
+    if (n < 11)
+        return;
+
+    // window sums include the point itself, the sums of float coordinates are
+    // exact in double so the window does not drift over the sweep
+    double sumX = 0, sumY = 0, sumZ = 0;
+    for (int k = 0; k < 11; k++)
+    {
+        sumX += x[k];
+        sumY += y[k];
+        sumZ += z[k];
+    }
+
+    for (int i = 5; i < n - 5; i++)
+    {
+        if (i > 5)
+        {
+            sumX += double(x[i + 5]) - x[i - 6];
+            sumY += double(y[i + 5]) - y[i - 6];
+            sumZ += double(z[i + 5]) - z[i - 6];
+        }
+        float diffX = float(sumX - 11.0 * x[i]);
+        float diffY = float(sumY - 11.0 * y[i]);
+        float diffZ = float(sumZ - 11.0 * z[i]);
+        curvature[i] = diffX * diffX + diffY * diffY + diffZ * diffZ;
+    }
+}
+
+#ifdef ALOAM_X86_SIMD
+
+__attribute__((target("sse2"))) static inline __m128 windowSSE(const float *p, __m128 ten)
+{
+    __m128 sum = _mm_add_ps(_mm_loadu_ps(p - 5), _mm_loadu_ps(p - 4));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p - 3));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p - 2));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p - 1));
+    sum = _mm_sub_ps(sum, _mm_mul_ps(ten, _mm_loadu_ps(p)));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p + 1));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p + 2));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p + 3));
+    sum = _mm_add_ps(sum, _mm_loadu_ps(p + 4));
+    return _mm_add_ps(sum, _mm_loadu_ps(p + 5));
+}
+
+__attribute__((target("sse2"))) static void curvatureSSE(const float *x, const float *y, const float *z,
+                                                          int n, float *curvature)
+{
+    const __m128 ten = _mm_set1_ps(10.0f);
+    int i = 5;
+    for (; i + 4 <= n - 5; i += 4)
+    {
+        __m128 diffX = windowSSE(x + i, ten);
+        __m128 diffY = windowSSE(y + i, ten);
+        __m128 diffZ = windowSSE(z + i, ten);
+        __m128 c = _mm_add_ps(_mm_mul_ps(diffX, diffX), _mm_mul_ps(diffY, diffY));
+        _mm_storeu_ps(curvature + i, _mm_add_ps(c, _mm_mul_ps(diffZ, diffZ)));
+    }
+    curvatureReference(x, y, z, i, n - 5, curvature);
+}
+
+__attribute__((target("avx2"))) static inline __m256 windowAVX2(const float *p, __m256 ten)
+{
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(p - 5), _mm256_loadu_ps(p - 4));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p - 3));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p - 2));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p - 1));
+    sum = _mm256_sub_ps(sum, _mm256_mul_ps(ten, _mm256_loadu_ps(p)));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + 1));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + 2));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + 3));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + 4));
+    return _mm256_add_ps(sum, _mm256_loadu_ps(p + 5));
+}
+
+__attribute__((target("avx2"))) static void curvatureAVX2(const float *x, const float *y, const float *z,
+                                                          int n, float *curvature)
+{
+    const __m256 ten = _mm256_set1_ps(10.0f);
+    int i = 5;
+    for (; i + 8 <= n - 5; i += 8)
+    {
+        __m256 diffX = windowAVX2(x + i, ten);
+        __m256 diffY = windowAVX2(y + i, ten);
+        __m256 diffZ = windowAVX2(z + i, ten);
+        __m256 c = _mm256_add_ps(_mm256_mul_ps(diffX, diffX), _mm256_mul_ps(diffY, diffY));
+        _mm256_storeu_ps(curvature + i, _mm256_add_ps(c, _mm256_mul_ps(diffZ, diffZ)));
+    }
+    curvatureSSE(x + i - 5, y + i - 5, z + i - 5, n - i + 5, curvature + i - 5);
+}
+
+#endif
+
+bool curvatureKernelSupported(CurvatureKernel kernel)
+{
+    switch (kernel)
+    {
+    case CurvatureKernel::Reference:
+    case CurvatureKernel::RunningSum:
+        return true;
+#ifdef ALOAM_X86_SIMD
+    case CurvatureKernel::SSE:
+        return __builtin_cpu_supports("sse2");
+    case CurvatureKernel::AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+CurvatureKernel bestCurvatureKernel()
+{
+    if (curvatureKernelSupported(CurvatureKernel::AVX2))
+        return CurvatureKernel::AVX2;
+    if (curvatureKernelSupported(CurvatureKernel::SSE))
+        return CurvatureKernel::SSE;
+    return CurvatureKernel::Reference;
+}
+
+bool parseCurvatureKernel(const std::string &name, CurvatureKernel &kernel)
+{
+    if (name == "auto")
+        kernel = bestCurvatureKernel();
+    else if (name == "reference")
+        kernel = CurvatureKernel::Reference;
+    else if (name == "running_sum")
+        kernel = CurvatureKernel::RunningSum;
+    else if (name == "sse")
+        kernel = CurvatureKernel::SSE;
+    else if (name == "avx2")
+        kernel = CurvatureKernel::AVX2;
+    else
+        return false;
+    return true;
+}
+
+const char *curvatureKernelName(CurvatureKernel kernel)
+{
+    switch (kernel)
+    {
+    case CurvatureKernel::Reference:
+        return "reference";
+    case CurvatureKernel::RunningSum:
+        return "running_sum";
+    case CurvatureKernel::SSE:
+        return "sse";
+    case CurvatureKernel::AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+void computeCurvature(CurvatureKernel kernel, const float *x, const float *y, const float *z,
+                      int n, float *curvature)
+{
+    switch (kernel)
+    {
+    case CurvatureKernel::RunningSum:
+        curvatureRunningSum(x, y, z, n, curvature);
+        return;
+#ifdef ALOAM_X86_SIMD
+    case CurvatureKernel::SSE:
+        curvatureSSE(x, y, z, n, curvature);
+        return;
+    case CurvatureKernel::AVX2:
+        curvatureAVX2(x, y, z, n, curvature);
+        return;
+#endif
+    default:
+        curvatureReference(x, y, z, 5, n - 5, curvature);
+        return;
+    }
+}
@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <cmath>
+#include "aloam_velodyne/feature_budget.h"
+
+FeatureBudgetController::FeatureBudgetController(const Options &options_)
+    : options(options_)
+{
+    updateBudget();
+}
+
+void FeatureBudgetController::addLatency(double newLatency)
+{
+    latency = hasLatency ? latency + options.smoothing * (newLatency - latency) : newLatency;
+    hasLatency = true;
+    if (options.targetLatency <= 0)
+        return;
+
+    double error = (options.targetLatency - latency) / options.targetLatency;
+    if (std::abs(error) <= options.deadBand)
+        return;
+
+    currentLevel = std::min(std::max(currentLevel + options.gain * error, 0.0), 1.0);
+    updateBudget();
+}
+
+bool FeatureBudgetController::saturated() const
+{
+    return options.targetLatency > 0 && currentLevel == 0 &&
+           latency > options.targetLatency * (1 + options.deadBand);
+}
+
+static int interpolateCount(int minCount, int maxCount, double level)
+{
+    return minCount + int(std::lround(level * (maxCount - minCount)));
+}
+
+void FeatureBudgetController::updateBudget()
+{
+    const FeatureExtractor::Budget &minBudget = options.minBudget;
+    const FeatureExtractor::Budget &maxBudget = options.maxBudget;
+    currentBudget.sharp = interpolateCount(minBudget.sharp, maxBudget.sharp, currentLevel);
+    currentBudget.lessSharp = interpolateCount(minBudget.lessSharp, maxBudget.lessSharp, currentLevel);
+    currentBudget.flat = interpolateCount(minBudget.flat, maxBudget.flat, currentLevel);
+    currentBudget.curvatureThreshold = minBudget.curvatureThreshold +
+                                       currentLevel * (maxBudget.curvatureThreshold - minBudget.curvatureThreshold);
+}
@@ -0,0 +1,706 @@
+// This is an advanced implementation of the algorithm described in the following paper:
+//   J. Zhang and S. Singh. LOAM: Lidar Odometry and Mapping in Real-time.
+//     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014. 
+
+// Modifier: Tong Qin               qintonguav@gmail.com
+// 	         Shaozu Cao 		    saozu.cao@connect.ust.hk
+
+
+// Copyright 2013, Ji Zhang, Carnegie Mellon University
+// Further contributions copyright (c) 2016, Southwest Research Institute
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "aloam_velodyne/feature_extractor.h"
+#include "aloam_velodyne/tic_toc.h"
+
+using std::atan2;
+
+void LaserFeatures::clear()
+{
+    laserCloud.clear();
+    cornerPointsSharp.clear();
+    cornerPointsLessSharp.clear();
+    surfPointsFlat.clear();
+    surfPointsLessFlat.clear();
+    timePrepare = 0;
+    timeSelectQ = 0;
+    timeSeparate = 0;
+}
+
+FeatureExtractor::FeatureExtractor(const Options &options_)
+    : options(options_)
+{
+    scanStartInd.resize(options.nScans, 0);
+    scanEndInd.resize(options.nScans, 0);
+    scanFeatures.resize(options.nScans);
+    for (int i = 0; i < options.nScans; i++)
+    {
+        scanFeatures[i].downSizeFilter.setLeafSize(0.2);
+        scanFeatures[i].groundDownSizeFilter.setLeafSize(options.ground.leafSize);
+    }
+}
+
+void FeatureExtractor::setThreadPool(ThreadPool *pool)
+{
+    threadPool = pool;
+}
+
+bool FeatureExtractor::isSupportedScanNum(int nScans)
+{
+    return nScans == 16 || nScans == 32 || nScans == 64;
+}
+
+// return -1 if the point is outside of the vertical field of view
+int FeatureExtractor::computeScanID(const pcl::PointXYZ &point) const
+{
+    const int N_SCANS = options.nScans;
+    float angle = atan(point.z / sqrt(point.x * point.x + point.y * point.y)) * 180 / M_PI;
+    int scanID = -1;
+
+    if (N_SCANS == 16)
+    {
+        scanID = int((angle + 15) / 2 + 0.5);
+        if (scanID > (N_SCANS - 1) || scanID < 0)
+            return -1;
+    }
+    else if (N_SCANS == 32)
+    {
+        scanID = int((angle + 92.0/3.0) * 3.0 / 4.0);
+        if (scanID > (N_SCANS - 1) || scanID < 0)
+            return -1;
+    }
+    else if (N_SCANS == 64)
+    {
+        if (angle >= -8.83)
+            scanID = int((2 - angle) * 3.0 + 0.5);
+        else
+            scanID = N_SCANS / 2 + int((-8.83 - angle) * 2.0 + 0.5);
+
+        // use [0 50]  > 50 remove outlies
+        if (angle > 2 || angle < -24.33 || scanID > 50 || scanID < 0)
+            return -1;
+    }
+    return scanID;
+}
+
+void FeatureExtractor::markNeighborPicked(const pcl::PointCloud<PointType> &laserCloud, int ind)
+{
+    cloudNeighborPicked[ind] = 1;
+    for (int l = 1; l <= 5; l++)
+    {
+        float diffX = laserCloud.points[ind + l].x - laserCloud.points[ind + l - 1].x;
+        float diffY = laserCloud.points[ind + l].y - laserCloud.points[ind + l - 1].y;
+        float diffZ = laserCloud.points[ind + l].z - laserCloud.points[ind + l - 1].z;
+        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
+        {
+            break;
+        }
+
+        cloudNeighborPicked[ind + l] = 1;
+    }
+    for (int l = -1; l >= -5; l--)
+    {
+        float diffX = laserCloud.points[ind + l].x - laserCloud.points[ind + l + 1].x;
+        float diffY = laserCloud.points[ind + l].y - laserCloud.points[ind + l + 1].y;
+        float diffZ = laserCloud.points[ind + l].z - laserCloud.points[ind + l + 1].z;
+        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
+        {
+            break;
+        }
+
+        cloudNeighborPicked[ind + l] = 1;
+    }
+}
+
+void FeatureExtractor::extractFiltered(const pcl::PointCloud<pcl::PointXYZ> &laserCloudIn, LaserFeatures &features)
+{
+    TicToc t_prepare;
+    features.clear();
+    extractByAngle(laserCloudIn, features, t_prepare);
+}
+
+// scan line from the elevation and time from the unwrapped azimuth of every point
+void FeatureExtractor::extractByAngle(const pcl::PointCloud<pcl::PointXYZ> &laserCloudIn,
+                                      LaserFeatures &features, TicToc &t_prepare)
+{
+    const double scanPeriod = options.scanPeriod;
+
+    laserCloudTagged.clear();
+    int cloudSize = laserCloudIn.points.size();
+    if (cloudSize == 0)
+    {
+        extractFromTagged(laserCloudTagged, features, t_prepare);
+        return;
+    }
+
+    float startOri = -atan2(laserCloudIn.points[0].y, laserCloudIn.points[0].x);
+    float endOri = -atan2(laserCloudIn.points[cloudSize - 1].y,
+                          laserCloudIn.points[cloudSize - 1].x) +
+                   2 * M_PI;
+
+    if (endOri - startOri > 3 * M_PI)
+    {
+        endOri -= 2 * M_PI;
+    }
+    else if (endOri - startOri < M_PI)
+    {
+        endOri += 2 * M_PI;
+    }
+
+    bool halfPassed = false;
+    PointType point;
+    for (int i = 0; i < cloudSize; i++)
+    {
+        point.x = laserCloudIn.points[i].x;
+        point.y = laserCloudIn.points[i].y;
+        point.z = laserCloudIn.points[i].z;
+
+        int scanID = computeScanID(laserCloudIn.points[i]);
+        if (scanID < 0)
+            continue;
+
+        float ori = -atan2(point.y, point.x);
+        if (!halfPassed)
+        {
+            if (ori < startOri - M_PI / 2)
+            {
+                ori += 2 * M_PI;
+            }
+            else if (ori > startOri + M_PI * 3 / 2)
+            {
+                ori -= 2 * M_PI;
+            }
+
+            if (ori - startOri > M_PI)
+            {
+                halfPassed = true;
+            }
+        }
+        else
+        {
+            ori += 2 * M_PI;
+            if (ori < endOri - M_PI * 3 / 2)
+            {
+                ori += 2 * M_PI;
+            }
+            else if (ori > endOri + M_PI / 2)
+            {
+                ori -= 2 * M_PI;
+            }
+        }
+
+        float relTime = (ori - startOri) / (endOri - startOri);
+        point.intensity = scanID + scanPeriod * relTime;
+        laserCloudTagged.push_back(point);
+    }
+
+    extractFromTagged(laserCloudTagged, features, t_prepare);
+}
+
+void FeatureExtractor::extractTagged(const pcl::PointCloud<PointType> &laserCloudIn, LaserFeatures &features)
+{
+    TicToc t_prepare;
+    features.clear();
+    extractFromTagged(laserCloudIn, features, t_prepare);
+}
+
+// every point carries its scan line, everything from here on is shared by both inputs
+void FeatureExtractor::extractFromTagged(const pcl::PointCloud<PointType> &laserCloudTagged,
+                                         LaserFeatures &features, TicToc &t_prepare)
+{
+    const int N_SCANS = options.nScans;
+    const float inverseScanPeriod = 1.0 / options.scanPeriod;
+
+    // counting sort into the rows of the range image, rows keep the input
+    // order of their points, so a row runs along the azimuth
+    RangeImage &rangeImage = features.rangeImage;
+    rangeImage.reset(N_SCANS, options.horizontalResolution);
+    const int tagSize = laserCloudTagged.points.size();
+    for (int i = 0; i < tagSize; i++)
+    {
+        int scanID = int(laserCloudTagged.points[i].intensity);
+        if (scanID >= 0 && scanID < N_SCANS)
+            rangeImage.rowStart[scanID + 1]++;
+    }
+    for (int i = 0; i < N_SCANS; i++)
+    {
+        rangeImage.rowStart[i + 1] += rangeImage.rowStart[i];
+        scanStartInd[i] = rangeImage.rowStart[i] + 5;
+        scanEndInd[i] = rangeImage.rowStart[i + 1] - 6;
+    }
+    int cloudSize = rangeImage.rowStart[N_SCANS];
+
+    pcl::PointCloud<PointType> &laserCloud = features.laserCloud;
+    laserCloud.points.resize(cloudSize);
+    laserCloud.width = cloudSize;
+    laserCloud.height = 1;
+    laserCloud.is_dense = true;
+    cloudX.resize(cloudSize);
+    cloudY.resize(cloudSize);
+    cloudZ.resize(cloudSize);
+    rowCursor.assign(rangeImage.rowStart.begin(), rangeImage.rowStart.end() - 1);
+    for (int i = 0; i < tagSize; i++)
+    {
+        const PointType &point = laserCloudTagged.points[i];
+        int scanID = int(point.intensity);
+        if (scanID < 0 || scanID >= N_SCANS)
+            continue;
+        int ind = rowCursor[scanID]++;
+        laserCloud.points[ind] = point;
+        cloudX[ind] = point.x;
+        cloudY[ind] = point.y;
+        cloudZ[ind] = point.z;
+
+        int &cell = rangeImage.cells[scanID * rangeImage.cols +
+                                     rangeImage.colOf((point.intensity - scanID) * inverseScanPeriod)];
+        if (cell < 0)
+            cell = ind;
+    }
+
+    features.timePrepare = t_prepare.toc();
+
+    cloudCurvature.resize(cloudSize);
+    cloudNeighborPicked.resize(cloudSize);
+    cloudLabel.resize(cloudSize);
+    cloudGround.resize(cloudSize);
+    computeCurvature(options.curvatureKernel, cloudX.data(), cloudY.data(), cloudZ.data(),
+                     cloudSize, cloudCurvature.data());
+    for (int i = 5; i < cloudSize - 5; i++)
+    {
+        cloudNeighborPicked[i] = 0;
+        cloudLabel[i] = 0;
+    }
+
+    TicToc t_pts;
+
+    forEachScan([this, &laserCloud, &rangeImage](int i) { extractScan(laserCloud, rangeImage, i); });
+
+    mergeScans(features);
+    features.timeSeparate = t_pts.toc();
+}
+
+void FeatureExtractor::forEachScan(const std::function<void(int)> &body)
+{
+    if (threadPool != nullptr && threadPool->size() > 0)
+    {
+        threadPool->parallelFor(0, options.nScans, body);
+    }
+    else
+    {
+        for (int i = 0; i < options.nScans; i++)
+            body(i);
+    }
+}
+
+// features of the scan lines in scan order
+void FeatureExtractor::mergeScans(LaserFeatures &features)
+{
+    float t_q_select = 0;
+    for (int i = 0; i < options.nScans; i++)
+    {
+        if (scanEndInd[i] - scanStartInd[i] < 6)
+            continue;
+        const ScanFeatures &scan = scanFeatures[i];
+        features.cornerPointsSharp += scan.cornerPointsSharp;
+        features.cornerPointsLessSharp += scan.cornerPointsLessSharp;
+        features.surfPointsFlat += scan.surfPointsFlat;
+        features.surfPointsLessFlat += scan.surfPointsLessFlatScanDS;
+        t_q_select += scan.timeSelectQ;
+    }
+    features.timeSelectQ = t_q_select;
+}
+
+// Labels the points [sp, ep] of scan line i. Only the first point of every
+// cell of the neighbouring lines is compared against, the other points of
+// the line are labelled on their own.
+void FeatureExtractor::labelGround(const pcl::PointCloud<PointType> &laserCloud, const RangeImage &rangeImage,
+                                   int i, int sp, int ep)
+{
+    const float inverseScanPeriod = 1.0 / options.scanPeriod;
+    const float maxSlope = std::tan(options.ground.maxSlope * M_PI / 180);
+
+    for (int k = sp; k <= ep; k++)
+    {
+        const PointType &point = laserCloud.points[k];
+        cloudGround[k] = 0;
+        if (point.z >= 0)
+            continue;
+
+        int col = rangeImage.colOf((point.intensity - i) * inverseScanPeriod);
+        for (int row = i - 1; row <= i + 1; row += 2)
+        {
+            if (row < 0 || row >= rangeImage.rows)
+                continue;
+            int ind = rangeImage.at(row, col);
+            if (ind < 0)
+                continue;
+
+            const PointType &neighbor = laserCloud.points[ind];
+            float diffX = neighbor.x - point.x;
+            float diffY = neighbor.y - point.y;
+            float diffZ = neighbor.z - point.z;
+            if (neighbor.z < 0 && std::abs(diffZ) <= maxSlope * std::sqrt(diffX * diffX + diffY * diffY))
+            {
+                cloudGround[k] = 1;
+                break;
+            }
+        }
+    }
+}
+
+void FeatureExtractor::beginScanFilters(ScanFeatures &scan)
+{
+    scan.surfPointsLessFlatScanDS.clear();
+    scan.downSizeFilter.begin();
+    if (options.ground.enabled)
+        scan.groundDownSizeFilter.begin();
+}
+
+// less flat points of the scan line, the ground ones after the others
+void FeatureExtractor::endScanFilters(ScanFeatures &scan)
+{
+    scan.downSizeFilter.end(scan.surfPointsLessFlatScanDS);
+    if (options.ground.enabled)
+        scan.groundDownSizeFilter.end(scan.surfPointsLessFlatScanDS);
+}
+
+// scan lines only touch their own range of the per point arrays, so
+// different scan lines can be processed at the same time
+void FeatureExtractor::extractScan(const pcl::PointCloud<PointType> &laserCloud, const RangeImage &rangeImage, int i)
+{
+    ScanFeatures &scan = scanFeatures[i];
+    scan.cornerPointsSharp.clear();
+    scan.cornerPointsLessSharp.clear();
+    scan.surfPointsFlat.clear();
+    scan.timeSelectQ = 0;
+
+    if( scanEndInd[i] - scanStartInd[i] < 6)
+        return;
+
+    beginScanFilters(scan);
+    if (options.ground.enabled)
+        labelGround(laserCloud, rangeImage, i, scanStartInd[i], scanEndInd[i]);
+    for (int j = 0; j < 6; j++)
+    {
+        int sp = scanStartInd[i] + (scanEndInd[i] - scanStartInd[i]) * j / 6;
+        int ep = scanStartInd[i] + (scanEndInd[i] - scanStartInd[i]) * (j + 1) / 6 - 1;
+        extractSextant(laserCloud, scan, sp, ep);
+    }
+
+    endScanFilters(scan);
+}
+
+// picks the features of the points [sp, ep] of a scan line and feeds the
+// remaining ones to the less flat filter of the scan line
+void FeatureExtractor::extractSextant(const pcl::PointCloud<PointType> &laserCloud, ScanFeatures &scan, int sp, int ep)
+{
+    // Only the budget.lessSharp sharpest and budget.flat flattest points that
+    // survive the neighbour suppression are used, so instead of sorting the
+    // whole sextant the candidates on each side of the threshold are kept in
+    // a heap and popped one by one until enough points were picked. Equal
+    // curvatures are taken in index order.
+    const std::vector<float> &curvature = cloudCurvature;
+    auto lessSharp = [&curvature](int a, int b) {
+        return curvature[a] < curvature[b] || (curvature[a] == curvature[b] && a > b);
+    };
+    auto lessFlat = [&curvature](int a, int b) {
+        return curvature[a] > curvature[b] || (curvature[a] == curvature[b] && a > b);
+    };
+    std::vector<int> &candidates = scan.candidates;
+    const Budget &budget = options.budget;
+    const bool limitGround = options.ground.enabled;
+
+    TicToc t_tmp;
+    candidates.clear();
+    for (int k = sp; k <= ep; k++)
+    {
+        if (cloudCurvature[k] > budget.curvatureThreshold)
+            candidates.push_back(k);
+    }
+    std::make_heap(candidates.begin(), candidates.end(), lessSharp);
+
+    int largestPickedNum = 0;
+    while (!candidates.empty())
+    {
+        std::pop_heap(candidates.begin(), candidates.end(), lessSharp);
+        int ind = candidates.back();
+        candidates.pop_back();
+
+        if (cloudNeighborPicked[ind] == 0)
+        {
+
+            largestPickedNum++;
+            if (largestPickedNum <= budget.sharp)
+            {
+                cloudLabel[ind] = 2;
+                scan.cornerPointsSharp.push_back(laserCloud.points[ind]);
+                scan.cornerPointsLessSharp.push_back(laserCloud.points[ind]);
+            }
+            else if (largestPickedNum <= budget.lessSharp)
+            {
+                cloudLabel[ind] = 1;
+                scan.cornerPointsLessSharp.push_back(laserCloud.points[ind]);
+            }
+            else
+            {
+                break;
+            }
+
+            markNeighborPicked(laserCloud, ind);
+        }
+    }
+
+    candidates.clear();
+    for (int k = sp; k <= ep; k++)
+    {
+        if (cloudCurvature[k] < budget.curvatureThreshold)
+            candidates.push_back(k);
+    }
+    std::make_heap(candidates.begin(), candidates.end(), lessFlat);
+
+    int smallestPickedNum = 0;
+    int groundPickedNum = 0;
+    while (!candidates.empty())
+    {
+        std::pop_heap(candidates.begin(), candidates.end(), lessFlat);
+        int ind = candidates.back();
+        candidates.pop_back();
+
+        if (limitGround && cloudGround[ind])
+        {
+            if (groundPickedNum >= options.ground.flat)
+                continue;
+            if (cloudNeighborPicked[ind] == 0)
+                groundPickedNum++;
+        }
+
+        if (cloudNeighborPicked[ind] == 0)
+        {
+
+            cloudLabel[ind] = -1;
+            scan.surfPointsFlat.push_back(laserCloud.points[ind]);
+
+            smallestPickedNum++;
+            if (smallestPickedNum >= budget.flat)
+            {
+                break;
+            }
+
+            markNeighborPicked(laserCloud, ind);
+        }
+    }
+    scan.timeSelectQ += t_tmp.toc();
+
+    for (int k = sp; k <= ep; k++)
+    {
+        if (cloudLabel[k] <= 0)
+        {
+            if (limitGround && cloudGround[k])
+                scan.groundDownSizeFilter.add(laserCloud.points[k]);
+            else
+                scan.downSizeFilter.add(laserCloud.points[k]);
+        }
+    }
+}
+
+void FeatureExtractor::beginSweep()
+{
+    const int N_SCANS = options.nScans;
+
+    // rows of the streamed sweep are laid out with a fixed stride, so they can
+    // grow independently while the segments come in
+    rowCapacity = 2 * options.horizontalResolution;
+    const size_t capacity = size_t(N_SCANS) * rowCapacity;
+    streamCloud.points.resize(capacity);
+    cloudX.resize(capacity);
+    cloudY.resize(capacity);
+    cloudZ.resize(capacity);
+    cloudCurvature.resize(capacity);
+    cloudNeighborPicked.resize(capacity);
+    cloudLabel.resize(capacity);
+    cloudGround.resize(capacity);
+    if (options.ground.enabled)
+        streamImage.reset(N_SCANS, options.horizontalResolution);
+
+    streamScans.resize(N_SCANS);
+    for (int i = 0; i < N_SCANS; i++)
+    {
+        StreamScan &row = streamScans[i];
+        row.count = 0;
+        row.sextant = 0;
+        row.nextSextant = 0;
+        row.nextStart = 5;
+        row.boundary[0] = 0;
+        for (int j = 1; j < 6; j++)
+            row.boundary[j] = -1;
+
+        ScanFeatures &scan = scanFeatures[i];
+        scan.cornerPointsSharp.clear();
+        scan.cornerPointsLessSharp.clear();
+        scan.surfPointsFlat.clear();
+        scan.timeSelectQ = 0;
+        beginScanFilters(scan);
+    }
+}
+
+void FeatureExtractor::addSegment(const pcl::PointCloud<PointType> &segment)
+{
+    const int N_SCANS = options.nScans;
+    const float inverseScanPeriod = 1.0 / options.scanPeriod;
+
+    for (size_t i = 0; i < segment.points.size(); i++)
+    {
+        const PointType &point = segment.points[i];
+        int scanID = int(point.intensity);
+        if (scanID < 0 || scanID >= N_SCANS)
+            continue;
+        StreamScan &row = streamScans[scanID];
+        // more points than the row can hold means a broken sweep, drop them
+        if (row.count >= rowCapacity)
+            continue;
+
+        int sextant = std::min(std::max(int((point.intensity - scanID) * inverseScanPeriod * 6), 0), 5);
+        while (row.sextant < sextant)
+        {
+            row.sextant++;
+            row.boundary[row.sextant] = row.count;
+        }
+
+        int ind = scanID * rowCapacity + row.count++;
+        streamCloud.points[ind] = point;
+        cloudX[ind] = point.x;
+        cloudY[ind] = point.y;
+        cloudZ[ind] = point.z;
+        cloudNeighborPicked[ind] = 0;
+        cloudLabel[ind] = 0;
+
+        if (options.ground.enabled)
+        {
+            int &cell = streamImage.cells[scanID * streamImage.cols +
+                                          streamImage.colOf((point.intensity - scanID) * inverseScanPeriod)];
+            if (cell < 0)
+                cell = ind;
+        }
+    }
+
+    forEachScan([this](int i) { processStreamScan(i, false); });
+}
+
+// Runs every sextant of the scan line whose points and the 5 neighbours
+// after them have arrived. Sextants are split at the azimuth boundaries
+// seen by addSegment(), the first 5 and last 5 points of the line are
+// skipped like for whole sweeps.
+void FeatureExtractor::processStreamScan(int i, bool sweepEnded)
+{
+    StreamScan &row = streamScans[i];
+    ScanFeatures &scan = scanFeatures[i];
+    const int base = i * rowCapacity;
+
+    while (row.nextSextant < 6)
+    {
+        int j = row.nextSextant;
+        bool boundaryKnown = j < 5 && row.boundary[j + 1] >= 0;
+        int ep;
+        if (boundaryKnown && row.count >= row.boundary[j + 1] + 5)
+            ep = row.boundary[j + 1] - 1;
+        else if (sweepEnded)
+            ep = boundaryKnown ? row.boundary[j + 1] - 1 : row.count - 6;
+        else
+            break;
+        ep = std::min(ep, row.count - 6);
+
+        int sp = row.nextStart;
+        if (ep >= sp)
+        {
+            // curvature of [sp, ep] needs the 5 points on either side
+            computeCurvature(options.curvatureKernel, &cloudX[base + sp - 5], &cloudY[base + sp - 5],
+                             &cloudZ[base + sp - 5], ep - sp + 11, &cloudCurvature[base + sp - 5]);
+            // cells of the other lines only hold points that arrived already,
+            // a neighbour still missing leaves the point off the ground
+            if (options.ground.enabled)
+                labelGround(streamCloud, streamImage, i, base + sp, base + ep);
+            extractSextant(streamCloud, scan, base + sp, base + ep);
+            row.nextStart = ep + 1;
+        }
+        row.nextSextant++;
+    }
+
+    if (sweepEnded)
+        endScanFilters(scan);
+}
+
+void FeatureExtractor::endSweep(LaserFeatures &features)
+{
+    const int N_SCANS = options.nScans;
+    const float inverseScanPeriod = 1.0 / options.scanPeriod;
+
+    TicToc t_pts;
+    features.clear();
+
+    forEachScan([this](int i) { processStreamScan(i, true); });
+
+    // the rows are only copied together once the features are picked
+    TicToc t_prepare;
+    RangeImage &rangeImage = features.rangeImage;
+    rangeImage.reset(N_SCANS, options.horizontalResolution);
+    for (int i = 0; i < N_SCANS; i++)
+    {
+        rangeImage.rowStart[i + 1] = rangeImage.rowStart[i] + streamScans[i].count;
+        scanStartInd[i] = rangeImage.rowStart[i] + 5;
+        scanEndInd[i] = rangeImage.rowStart[i + 1] - 6;
+    }
+    int cloudSize = rangeImage.rowStart[N_SCANS];
+
+    pcl::PointCloud<PointType> &laserCloud = features.laserCloud;
+    laserCloud.points.resize(cloudSize);
+    laserCloud.width = cloudSize;
+    laserCloud.height = 1;
+    laserCloud.is_dense = true;
+    for (int i = 0; i < N_SCANS; i++)
+    {
+        const int base = i * rowCapacity;
+        for (int k = 0; k < streamScans[i].count; k++)
+        {
+            const PointType &point = streamCloud.points[base + k];
+            int ind = rangeImage.rowStart[i] + k;
+            laserCloud.points[ind] = point;
+
+            int &cell = rangeImage.cells[i * rangeImage.cols +
+                                         rangeImage.colOf((point.intensity - i) * inverseScanPeriod)];
+            if (cell < 0)
+                cell = ind;
+        }
+    }
+    features.timePrepare = t_prepare.toc();
+
+    mergeScans(features);
+    features.timeSeparate = t_pts.toc();
+}
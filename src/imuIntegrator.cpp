@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cmath>
+#include "aloam_velodyne/imu_integrator.h"
+
+ImuIntegrator::ImuIntegrator(const Eigen::Quaterniond &q_lidar_imu, double bufferTime)
+    : q_lidar_imu(q_lidar_imu.normalized()), bufferTime(bufferTime)
+{
+}
+
+void ImuIntegrator::addSample(double time, const Eigen::Vector3d &angularVelocity)
+{
+    std::lock_guard<std::mutex> lock(mSamples);
+    if (!samples.empty() && time <= samples.back().time)
+        return;
+
+    Sample sample;
+    sample.time = time;
+    sample.angularVelocity = angularVelocity;
+    samples.push_back(sample);
+    while (samples.front().time < time - bufferTime)
+        samples.pop_front();
+}
+
+// rotation by the vector angle * axis
+static Eigen::Quaterniond deltaRotation(const Eigen::Vector3d &theta)
+{
+    double angle = theta.norm();
+    if (angle < 1e-12)
+        return Eigen::Quaterniond::Identity();
+    return Eigen::Quaterniond(Eigen::AngleAxisd(angle, theta / angle));
+}
+
+bool ImuIntegrator::rotations(double t0, double dt, int count, Rotations &rotations)
+{
+    std::lock_guard<std::mutex> lock(mSamples);
+    if (samples.empty() || samples.front().time > t0)
+        return false;
+
+    // newest sample at or before t0
+    size_t i = 0;
+    while (i + 1 < samples.size() && samples[i + 1].time <= t0)
+        i++;
+
+    rotations.resize(count);
+    Eigen::Quaterniond q = Eigen::Quaterniond::Identity();
+    double t = t0;
+    for (int k = 0; k < count; k++)
+    {
+        double target = t0 + k * dt;
+        while (t < target)
+        {
+            while (i + 1 < samples.size() && samples[i + 1].time <= t)
+                i++;
+            double next = target;
+            if (i + 1 < samples.size())
+                next = std::min(next, samples[i + 1].time);
+            q = q * deltaRotation(samples[i].angularVelocity * (next - t));
+            t = next;
+        }
+        q.normalize();
+        rotations[k] = q_lidar_imu * q * q_lidar_imu.conjugate();
+    }
+    return true;
+}
+
+bool ImuIntegrator::rotation(double t0, double t1, Eigen::Quaterniond &q)
+{
+    Rotations ends;
+    if (!rotations(t0, t1 - t0, 2, ends))
+        return false;
+    q = ends[1];
+    return true;
+}
+
+void deskewCloud(pcl::PointCloud<PointType> &cloud, const ImuIntegrator::Rotations &knots, double scanPeriod)
+{
+    const int numSegments = knots.size() - 1;
+    if (numSegments < 1)
+        return;
+
+    std::vector<Eigen::Matrix3f> knotMatrices(knots.size());
+    for (size_t k = 0; k < knots.size(); k++)
+        knotMatrices[k] = knots[k].toRotationMatrix().cast<float>();
+
+    // the rotation changes little between knots, so the matrices are
+    // interpolated linearly instead of slerping every point
+    const float inverseScanPeriod = 1.0 / scanPeriod;
+    for (size_t i = 0; i < cloud.points.size(); i++)
+    {
+        PointType &point = cloud.points[i];
+        float relTime = (point.intensity - int(point.intensity)) * inverseScanPeriod;
+        float knot = std::min(std::max(relTime, 0.0f), 1.0f) * numSegments;
+        int k = std::min(int(knot), numSegments - 1);
+        float ratio = knot - k;
+        Eigen::Matrix3f R = knotMatrices[k] + ratio * (knotMatrices[k + 1] - knotMatrices[k]);
+        Eigen::Vector3f p = R * Eigen::Vector3f(point.x, point.y, point.z);
+        point.x = p.x();
+        point.y = p.y();
+        point.z = p.z();
+    }
+}
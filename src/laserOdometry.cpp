@@ -34,6 +34,7 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+#include <algorithm>
 #include <cmath>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
@@ -50,553 +51,870 @@
 #include <tf/transform_broadcaster.h>
 #include <eigen3/Eigen/Dense>
 #include <mutex>
-#include <queue>
 
+#include "aloam_velodyne/cloud_msg.h"
 #include "aloam_velodyne/common.h"
+#include "aloam_velodyne/feature_bundle.h"
+#include "aloam_velodyne/laser_odometry.h"
 #include "aloam_velodyne/tic_toc.h"
 #include "lidarFactor.hpp"
 
-#define DISTORTION 0
-
-
-int corner_correspondence = 0, plane_correspondence = 0;
-
 constexpr double SCAN_PERIOD = 0.1;
 constexpr double DISTANCE_SQ_THRESHOLD = 25;
 constexpr double NEARBY_SCAN = 2.5;
-
-int skipFrameNum = 5;
-bool systemInited = false;
-
-double timeCornerPointsSharp = 0;
-double timeCornerPointsLessSharp = 0;
-double timeSurfPointsFlat = 0;
-double timeSurfPointsLessFlat = 0;
-double timeLaserCloudFullRes = 0;
-
-pcl::KdTreeFLANN<pcl::PointXYZI>::Ptr kdtreeCornerLast(new pcl::KdTreeFLANN<pcl::PointXYZI>());
-pcl::KdTreeFLANN<pcl::PointXYZI>::Ptr kdtreeSurfLast(new pcl::KdTreeFLANN<pcl::PointXYZI>());
-
-pcl::PointCloud<PointType>::Ptr cornerPointsSharp(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr cornerPointsLessSharp(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr surfPointsFlat(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr surfPointsLessFlat(new pcl::PointCloud<PointType>());
-
-pcl::PointCloud<PointType>::Ptr laserCloudCornerLast(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr laserCloudSurfLast(new pcl::PointCloud<PointType>());
-pcl::PointCloud<PointType>::Ptr laserCloudFullRes(new pcl::PointCloud<PointType>());
-
-int laserCloudCornerLastNum = 0;
-int laserCloudSurfLastNum = 0;
-
-// Transformation from current frame to world frame
-Eigen::Quaterniond q_w_curr(1, 0, 0, 0);
-Eigen::Vector3d t_w_curr(0, 0, 0);
-
-// q_curr_last(x, y, z, w), t_curr_last
-double para_q[4] = {0, 0, 0, 1};
-double para_t[3] = {0, 0, 0};
-
-Eigen::Map<Eigen::Quaterniond> q_last_curr(para_q);
-Eigen::Map<Eigen::Vector3d> t_last_curr(para_t);
-
-std::queue<sensor_msgs::PointCloud2ConstPtr> cornerSharpBuf;
-std::queue<sensor_msgs::PointCloud2ConstPtr> cornerLessSharpBuf;
-std::queue<sensor_msgs::PointCloud2ConstPtr> surfFlatBuf;
-std::queue<sensor_msgs::PointCloud2ConstPtr> surfLessFlatBuf;
-std::queue<sensor_msgs::PointCloud2ConstPtr> fullPointsBuf;
-std::mutex mBuf;
+// the motion within a sweep is interpolated between this many segments
+constexpr int DISTORTION_SEGMENTS = 16;
 
 // undistort lidar point
-void TransformToStart(PointType const *const pi, PointType *const po)
+void LaserOdometry::TransformToStart(PointType const *const pi, PointType *const po)
 {
-    //interpolation ratio
-    double s;
-    if (DISTORTION)
-        s = (pi->intensity - int(pi->intensity)) / SCAN_PERIOD;
-    else
-        s = 1.0;
-    //s = 1;
-    Eigen::Quaterniond q_point_last = Eigen::Quaterniond::Identity().slerp(s, q_last_curr);
-    Eigen::Vector3d t_point_last = s * t_last_curr;
-    Eigen::Vector3d point(pi->x, pi->y, pi->z);
-    Eigen::Vector3d un_point = q_point_last * point + t_point_last;
-
-    po->x = un_point.x();
-    po->y = un_point.y();
-    po->z = un_point.z();
-    po->intensity = pi->intensity;
+    sweepMotion.toStart(*pi, *po);
 }
 
-// transform all lidar points to the start of the next frame
+// received clouds are shared, so the transformed points go to a new cloud
+pcl::PointCloud<PointType>::Ptr LaserOdometry::transformCloudToEnd(const pcl::PointCloud<PointType> &cloud)
+{
+    pcl::PointCloud<PointType>::Ptr cloudEnd(new pcl::PointCloud<PointType>());
+    sweepMotion.toEnd(cloud, *cloudEnd);
+    return cloudEnd;
+}
 
-void TransformToEnd(PointType const *const pi, PointType *const po)
+void LaserOdometry::laserCloudSharpHandler(const pcl::PointCloud<PointType>::ConstPtr &cornerPointsSharp2)
 {
-    // undistort point first
-    pcl::PointXYZI un_point_tmp;
-    TransformToStart(pi, &un_point_tmp);
+    if (!cornerSharpBuf.push(cornerPointsSharp2))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu sharp corner clouds", (unsigned long)cornerSharpBuf.dropped());
+    wakeProcess();
+}
 
-    Eigen::Vector3d un_point(un_point_tmp.x, un_point_tmp.y, un_point_tmp.z);
-    Eigen::Vector3d point_end = q_last_curr.inverse() * (un_point - t_last_curr);
+void LaserOdometry::laserCloudLessSharpHandler(const pcl::PointCloud<PointType>::ConstPtr &cornerPointsLessSharp2)
+{
+    if (!cornerLessSharpBuf.push(cornerPointsLessSharp2))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu less sharp corner clouds", (unsigned long)cornerLessSharpBuf.dropped());
+    wakeProcess();
+}
 
-    po->x = point_end.x();
-    po->y = point_end.y();
-    po->z = point_end.z();
+void LaserOdometry::laserCloudFlatHandler(const pcl::PointCloud<PointType>::ConstPtr &surfPointsFlat2)
+{
+    if (!surfFlatBuf.push(surfPointsFlat2))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu flat surface clouds", (unsigned long)surfFlatBuf.dropped());
+    wakeProcess();
+}
 
-    //Remove distortion time info
-    po->intensity = int(pi->intensity);
+void LaserOdometry::laserCloudLessFlatHandler(const pcl::PointCloud<PointType>::ConstPtr &surfPointsLessFlat2)
+{
+    if (!surfLessFlatBuf.push(surfPointsLessFlat2))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu less flat surface clouds", (unsigned long)surfLessFlatBuf.dropped());
+    wakeProcess();
 }
 
-void laserCloudSharpHandler(const sensor_msgs::PointCloud2ConstPtr &cornerPointsSharp2)
+//receive all point cloud
+void LaserOdometry::laserCloudFullResHandler(const pcl::PointCloud<PointType>::ConstPtr &laserCloudFullRes2)
 {
-    mBuf.lock();
-    cornerSharpBuf.push(cornerPointsSharp2);
-    mBuf.unlock();
+    if (!fullPointsBuf.push(laserCloudFullRes2))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu full clouds", (unsigned long)fullPointsBuf.dropped());
+    wakeProcess();
 }
 
-void laserCloudLessSharpHandler(const sensor_msgs::PointCloud2ConstPtr &cornerPointsLessSharp2)
+void LaserOdometry::featureBundleHandler(const aloam_velodyne::FeatureBundleConstPtr &featureBundle)
 {
-    mBuf.lock();
-    cornerLessSharpBuf.push(cornerPointsLessSharp2);
-    mBuf.unlock();
+    if (!featureBundleBuf.push(featureBundle))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu feature bundles", (unsigned long)featureBundleBuf.dropped());
+    wakeProcess();
 }
 
-void laserCloudFlatHandler(const sensor_msgs::PointCloud2ConstPtr &surfPointsFlat2)
+void LaserOdometry::imuRotationHandler(const geometry_msgs::QuaternionStampedConstPtr &imuRotation)
 {
-    mBuf.lock();
-    surfFlatBuf.push(surfPointsFlat2);
-    mBuf.unlock();
+    if (!imuRotationBuf.push(imuRotation))
+        ROS_WARN_THROTTLE(1.0, "odometry fell behind, dropped %lu imu rotations", (unsigned long)imuRotationBuf.dropped());
+    wakeProcess();
 }
 
-void laserCloudLessFlatHandler(const sensor_msgs::PointCloud2ConstPtr &surfPointsLessFlat2)
+// imu rotation between the last sweep and the sweep at time, false if
+// scanRegistration sent none. Clouds carry microsecond stamps, so the
+// stamps are compared with a tolerance.
+bool LaserOdometry::fetchImuRotation(double time, Eigen::Quaterniond &q)
 {
-    mBuf.lock();
-    surfLessFlatBuf.push(surfPointsLessFlat2);
-    mBuf.unlock();
+    while (!imuRotationBuf.empty() && imuRotationBuf.front()->header.stamp.toSec() < time - 1e-3)
+        imuRotationBuf.pop();
+    if (imuRotationBuf.empty() || imuRotationBuf.front()->header.stamp.toSec() > time + 1e-3)
+        return false;
+
+    const geometry_msgs::Quaternion &rotation = imuRotationBuf.front()->quaternion;
+    q = Eigen::Quaterniond(rotation.w, rotation.x, rotation.y, rotation.z);
+    imuRotationBuf.pop();
+    return true;
 }
 
-//receive all point cloud
-void laserCloudFullResHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudFullRes2)
+// true if the queues hold a frame of every input
+bool LaserOdometry::sweepQueued()
 {
-    mBuf.lock();
-    fullPointsBuf.push(laserCloudFullRes2);
-    mBuf.unlock();
+    if (USE_FEATURE_BUNDLE)
+        return !featureBundleBuf.empty();
+    return !cornerSharpBuf.empty() && !cornerLessSharpBuf.empty() &&
+           !surfFlatBuf.empty() && !surfLessFlatBuf.empty() &&
+           !fullPointsBuf.empty();
 }
 
-int main(int argc, char **argv)
+// pop the next sweep from the five cloud queues, false if one is still missing.
+// The queues drop frames on their own when the matching falls behind, so
+// the frames older than the newest front are skipped until all fronts match.
+bool LaserOdometry::fetchFeatureClouds()
 {
-    ros::init(argc, argv, std::string(getenv("DRONE_NAME")) + "_laserOdometry");
-    ros::NodeHandle nh;
+    FrameQueue<pcl::PointCloud<PointType>::ConstPtr> *queues[] = {&cornerSharpBuf, &cornerLessSharpBuf, &surfFlatBuf,
+                                                                 &surfLessFlatBuf, &fullPointsBuf};
+    const int numQueues = sizeof(queues) / sizeof(queues[0]);
+    while (true)
+    {
+        if (!sweepQueued())
+            return false;
+
+        double newestTime = 0;
+        for (int i = 0; i < numQueues; i++)
+            newestTime = std::max(newestTime, cloudTime(*queues[i]->front()));
+
+        bool synced = true;
+        for (int i = 0; i < numQueues; i++)
+        {
+            if (cloudTime(*queues[i]->front()) < newestTime)
+            {
+                queues[i]->pop();
+                synced = false;
+            }
+        }
+        if (synced)
+            break;
+        printf("unsync messeage! skip the clouds before %f \n", newestTime);
+    }
+
+    timeCornerPointsSharp = cloudTime(*cornerSharpBuf.front());
+    timeCornerPointsLessSharp = cloudTime(*cornerLessSharpBuf.front());
+    timeSurfPointsFlat = cloudTime(*surfFlatBuf.front());
+    timeSurfPointsLessFlat = cloudTime(*surfLessFlatBuf.front());
+    timeLaserCloudFullRes = cloudTime(*fullPointsBuf.front());
+
+    cornerPointsSharp = cornerSharpBuf.front();
+    cornerSharpBuf.pop();
+
+    cornerPointsLessSharp = cornerLessSharpBuf.front();
+    cornerLessSharpBuf.pop();
+
+    surfPointsFlat = surfFlatBuf.front();
+    surfFlatBuf.pop();
 
+    surfPointsLessFlat = surfLessFlatBuf.front();
+    surfLessFlatBuf.pop();
+
+    laserCloudFullRes = fullPointsBuf.front();
+    fullPointsBuf.pop();
+    return true;
+}
+
+// pop the next sweep from the bundle queue, all sets share one stamp
+bool LaserOdometry::fetchFeatureBundle()
+{
+    if (featureBundleBuf.empty())
+        return false;
+    aloam_velodyne::FeatureBundleConstPtr featureBundle = featureBundleBuf.front();
+    featureBundleBuf.pop();
+
+    // the sets are kept and published on, so every sweep gets new clouds
+    pcl::PointCloud<PointType>::Ptr clouds[aloam_velodyne::FeatureBundle::NUM_SETS];
+    pcl::PointCloud<PointType> *sets[aloam_velodyne::FeatureBundle::NUM_SETS];
+    for (int i = 0; i < aloam_velodyne::FeatureBundle::NUM_SETS; i++)
+    {
+        clouds[i].reset(new pcl::PointCloud<PointType>());
+        sets[i] = clouds[i].get();
+    }
+    if (!unpackFeatureBundle(*featureBundle, laserCloudBundle, sets))
+    {
+        ROS_WARN("broken feature bundle, skip it");
+        return false;
+    }
+    for (int i = 0; i < aloam_velodyne::FeatureBundle::NUM_SETS; i++)
+        setCloudHeader(*clouds[i], featureBundle->header.stamp, featureBundle->header.frame_id);
+
+    laserCloudFullRes = clouds[aloam_velodyne::FeatureBundle::FULL_CLOUD];
+    cornerPointsSharp = clouds[aloam_velodyne::FeatureBundle::CORNER_SHARP];
+    cornerPointsLessSharp = clouds[aloam_velodyne::FeatureBundle::CORNER_LESS_SHARP];
+    surfPointsFlat = clouds[aloam_velodyne::FeatureBundle::SURF_FLAT];
+    surfPointsLessFlat = clouds[aloam_velodyne::FeatureBundle::SURF_LESS_FLAT];
+
+    // the times of the stamped clouds, rounded to microseconds like the
+    // clouds laserMapping matches the odometry against
+    timeLaserCloudFullRes = cloudTime(*laserCloudFullRes);
+    timeCornerPointsSharp = cloudTime(*cornerPointsSharp);
+    timeCornerPointsLessSharp = cloudTime(*cornerPointsLessSharp);
+    timeSurfPointsFlat = cloudTime(*surfPointsFlat);
+    timeSurfPointsLessFlat = cloudTime(*surfPointsLessFlat);
+    return true;
+}
+
+LaserOdometry::LaserOdometry(ros::NodeHandle &nh, const std::string &droneName, ThreadPool *sharedPool)
+    : droneName(droneName), sweepMotion(SCAN_PERIOD, DISTORTION_SEGMENTS)
+{
     nh.param<int>("mapping_skip_frame", skipFrameNum, 2);
 
     printf("Mapping %d Hz \n", 10 / skipFrameNum);
 
-    ros::Subscriber subCornerPointsSharp = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_sharp", 100, laserCloudSharpHandler);
+    nh.param<bool>("feature_bundle", USE_FEATURE_BUNDLE, false);
+
+    // compensate the motion within a sweep, needs the relative time in the intensity
+    nh.param<bool>("distortion", DISTORTION, false);
+    // with the imu scanRegistration has already deskewed the features, moving
+    // them by the sweep motion again would compensate the rotation twice
+    nh.param<bool>("use_imu", USE_IMU, false);
+    if (DISTORTION && USE_IMU)
+    {
+        ROS_WARN("distortion and use_imu both deskew the sweep, turn distortion off");
+        DISTORTION = false;
+    }
+    printf("odometry distortion compensation %s \n", DISTORTION ? "on" : "off");
+
+    std::string backendParam;
+    nh.param<std::string>("scan_matching_backend", backendParam, "autodiff");
+    if (!parseScanMatchingBackend(backendParam, scanMatchingBackend))
+        printf("unknown scan matching backend %s, use autodiff \n", backendParam.c_str());
+    printf("odometry scan matching backend %s \n", scanMatchingBackendName(scanMatchingBackend));
+    if (scanMatchingBackend == ScanMatchingBackend::GaussNewton)
+        gaussNewtonTerms.reset(new LidarBatchFactor(0.1));
+
+    std::string motionModel;
+    MotionPredictor::Model model = MotionPredictor::Model::ConstantVelocity;
+    nh.param<std::string>("motion_model", motionModel, "constant_velocity");
+    if (!MotionPredictor::parseModel(motionModel, model))
+        printf("unknown motion model %s, use constant_velocity \n", motionModel.c_str());
+    motionPredictor = MotionPredictor(model);
+
+    // stop the registration early once the pose moves less than this, 0 to always iterate
+    nh.param<double>("odometry_convergence_rotation", convergenceTolerance.rotation, 0.0);
+    nh.param<double>("odometry_convergence_translation", convergenceTolerance.translation, 0.0);
+
+    nh.param<bool>("projective_association", PROJECTIVE_ASSOCIATION, false);
+    if (PROJECTIVE_ASSOCIATION)
+    {
+        int azimuthBins = 360, searchBins = 2;
+        nh.param<int>("projective_azimuth_bins", azimuthBins, 360);
+        nh.param<int>("projective_search_bins", searchBins, 2);
+        printf("projective association with %d azimuth bins, search %d bins to each side \n", azimuthBins, searchBins);
+        projectiveCornerLast.setResolution(azimuthBins, searchBins);
+        projectiveSurfLast.setResolution(azimuthBins, searchBins);
+    }
 
-    ros::Subscriber subCornerPointsLessSharp = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_less_sharp", 100, laserCloudLessSharpHandler);
+    // search the correspondences of the features on a pool, the shared one
+    // of the process or odometry_threads - 1 own threads and the caller
+    int numThreads = 1;
+    nh.param<int>("odometry_threads", numThreads, 1);
+    if (sharedPool)
+    {
+        associationPool = sharedPool;
+    }
+    else if (numThreads > 1)
+    {
+        printf("odometry threads %d \n", numThreads);
+        threadPool.reset(new ThreadPool(numThreads - 1));
+        associationPool = threadPool.get();
+    }
 
-    ros::Subscriber subSurfPointsFlat = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_flat", 100, laserCloudFlatHandler);
+    // frames every input holds while the matching is busy, older ones are dropped
+    int frameQueueSize = 10;
+    nh.param<int>("frame_queue_size", frameQueueSize, 10);
+    frameQueueSize = std::max(frameQueueSize, 1);
+    cornerSharpBuf.setCapacity(frameQueueSize);
+    cornerLessSharpBuf.setCapacity(frameQueueSize);
+    surfFlatBuf.setCapacity(frameQueueSize);
+    surfLessFlatBuf.setCapacity(frameQueueSize);
+    fullPointsBuf.setCapacity(frameQueueSize);
+    featureBundleBuf.setCapacity(frameQueueSize);
+    imuRotationBuf.setCapacity(frameQueueSize);
+
+    if (USE_IMU)
+        subImuRotation = nh.subscribe<geometry_msgs::QuaternionStamped>(droneName + "/laser_imu_rotation", 100, &LaserOdometry::imuRotationHandler, this);
+
+    // subscribing to the single clouds as well would make scanRegistration publish them
+    if (USE_FEATURE_BUNDLE)
+    {
+        subFeatureBundle = nh.subscribe<aloam_velodyne::FeatureBundle>(droneName + "/laser_feature_bundle", 100, &LaserOdometry::featureBundleHandler, this);
+    }
+    else
+    {
+        subCornerPointsSharp = nh.subscribe<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_sharp", 100, &LaserOdometry::laserCloudSharpHandler, this);
 
-    ros::Subscriber subSurfPointsLessFlat = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_less_flat", 100, laserCloudLessFlatHandler);
+        subCornerPointsLessSharp = nh.subscribe<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_less_sharp", 100, &LaserOdometry::laserCloudLessSharpHandler, this);
 
-    ros::Subscriber subLaserCloudFullRes = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/velodyne_cloud_2", 100, laserCloudFullResHandler);
+        subSurfPointsFlat = nh.subscribe<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_flat", 100, &LaserOdometry::laserCloudFlatHandler, this);
 
-    ros::Publisher pubLaserCloudCornerLast = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_corner_last", 100);
+        subSurfPointsLessFlat = nh.subscribe<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_less_flat", 100, &LaserOdometry::laserCloudLessFlatHandler, this);
 
-    ros::Publisher pubLaserCloudSurfLast = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_surf_last", 100);
+        subLaserCloudFullRes = nh.subscribe<pcl::PointCloud<PointType>>(droneName + "/velodyne_cloud_2", 100, &LaserOdometry::laserCloudFullResHandler, this);
+    }
 
-    ros::Publisher pubLaserCloudFullRes = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/velodyne_cloud_3", 100);
+    pubLaserCloudCornerLast = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_corner_last", 100);
 
-    ros::Publisher pubLaserOdometry = nh.advertise<nav_msgs::Odometry>(std::string(getenv("DRONE_NAME")) + "/laser_odom_to_init", 100);
+    pubLaserCloudSurfLast = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_surf_last", 100);
 
-    ros::Publisher pubLaserPath = nh.advertise<nav_msgs::Path>(std::string(getenv("DRONE_NAME")) + "/laser_odom_path", 100);
+    pubLaserCloudFullRes = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/velodyne_cloud_3", 100);
 
-    nav_msgs::Path laserPath;
+    pubLaserOdometry = nh.advertise<nav_msgs::Odometry>(droneName + "/laser_odom_to_init", 100);
 
-    int frameCount = 0;
-    ros::Rate rate(100);
+    int pathLength = 1000, pathDecimation = 1;
+    nh.param<int>("path_length", pathLength, 1000);
+    nh.param<int>("path_decimation", pathDecimation, 1);
+    laserPath.advertise(nh, droneName + "/laser_odom_path", droneName + "/laser_odom_pose", pathLength, pathDecimation);
 
-    while (ros::ok())
+    if (sharedPool)
     {
-        ros::spinOnce();
+        odometryTask.reset(new PoolTask(*sharedPool, [this]() {
+            while (running && processFrame())
+                ;
+        }));
+    }
+    else
+    {
+        odometryThread = std::thread(&LaserOdometry::process, this);
+    }
+}
 
-        if (!cornerSharpBuf.empty() && !cornerLessSharpBuf.empty() &&
-            !surfFlatBuf.empty() && !surfLessFlatBuf.empty() &&
-            !fullPointsBuf.empty())
+LaserOdometry::~LaserOdometry()
+{
+    running = false;
+    if (odometryTask)
+    {
+        odometryTask.reset();
+    }
+    else
+    {
+        // the flag is read under the lock, so the thread cannot miss the wakeup
         {
-            timeCornerPointsSharp = cornerSharpBuf.front()->header.stamp.toSec();
-            timeCornerPointsLessSharp = cornerLessSharpBuf.front()->header.stamp.toSec();
-            timeSurfPointsFlat = surfFlatBuf.front()->header.stamp.toSec();
-            timeSurfPointsLessFlat = surfLessFlatBuf.front()->header.stamp.toSec();
-            timeLaserCloudFullRes = fullPointsBuf.front()->header.stamp.toSec();
-
-            if (timeCornerPointsSharp != timeLaserCloudFullRes ||
-                timeCornerPointsLessSharp != timeLaserCloudFullRes ||
-                timeSurfPointsFlat != timeLaserCloudFullRes ||
-                timeSurfPointsLessFlat != timeLaserCloudFullRes)
+            std::lock_guard<std::mutex> lock(mBuf);
+        }
+        cvBuf.notify_all();
+        odometryThread.join();
+    }
+}
+
+// every input may complete a sweep
+void LaserOdometry::wakeProcess()
+{
+    if (odometryTask)
+    {
+        odometryTask->notify();
+    }
+    else
+    {
+        // the thread checks the queues under the lock, so taking it once after
+        // the push keeps the wakeup from falling between its check and its wait
+        {
+            std::lock_guard<std::mutex> lock(mBuf);
+        }
+        cvBuf.notify_one();
+    }
+}
+
+// processes the queued sweeps and sleeps until the callbacks complete the next one
+void LaserOdometry::process()
+{
+    while (running && ros::ok())
+    {
+        while (running && processFrame())
+            ;
+
+        std::unique_lock<std::mutex> lock(mBuf);
+        cvBuf.wait(lock, [this]() { return !running || sweepQueued(); });
+    }
+}
+
+// Nearest point to the corner i among the last corners and the nearest one on
+// a nearby scan line, -1 if there is none. Only reads the state of the
+// sweep, so it runs for several features at the same time.
+void LaserOdometry::findCornerCorrespondence(int i, int &closestPointInd, int &minPointInd2)
+{
+    pcl::PointXYZI pointSel;
+    TransformToStart(&(cornerPointsSharp->points[i]), &pointSel);
+
+    if (PROJECTIVE_ASSOCIATION)
+    {
+        const int nearbyScans = int(NEARBY_SCAN);
+        int scanID = int(pointSel.intensity);
+        closestPointInd = projectiveCornerLast.nearest(pointSel, scanID - nearbyScans, scanID + nearbyScans, -1, -1,
+                                                       DISTANCE_SQ_THRESHOLD);
+        minPointInd2 = -1;
+        if (closestPointInd >= 0)
+        {
+            int closestPointScanID = int(laserCloudCornerLast->points[closestPointInd].intensity);
+            minPointInd2 = projectiveCornerLast.nearest(pointSel, closestPointScanID - nearbyScans,
+                                                        closestPointScanID + nearbyScans, closestPointScanID, -1,
+                                                        DISTANCE_SQ_THRESHOLD);
+        }
+        return;
+    }
+
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    kdtreeCornerLast->nearestKSearch(pointSel, 1, pointSearchInd, pointSearchSqDis);
+
+    closestPointInd = -1;
+    minPointInd2 = -1;
+    if (pointSearchSqDis[0] < DISTANCE_SQ_THRESHOLD)
+    {
+        closestPointInd = pointSearchInd[0];
+        int closestPointScanID = int(laserCloudCornerLast->points[closestPointInd].intensity);
+
+        double minPointSqDis2 = DISTANCE_SQ_THRESHOLD;
+        // search in the direction of increasing scan line
+        for (int j = closestPointInd + 1; j < (int)laserCloudCornerLast->points.size(); ++j)
+        {
+            // if in the same scan line, continue
+            if (int(laserCloudCornerLast->points[j].intensity) <= closestPointScanID)
+                continue;
+
+            // if not in nearby scans, end the loop
+            if (int(laserCloudCornerLast->points[j].intensity) > (closestPointScanID + NEARBY_SCAN))
+                break;
+
+            double pointSqDis = (laserCloudCornerLast->points[j].x - pointSel.x) *
+                                    (laserCloudCornerLast->points[j].x - pointSel.x) +
+                                (laserCloudCornerLast->points[j].y - pointSel.y) *
+                                    (laserCloudCornerLast->points[j].y - pointSel.y) +
+                                (laserCloudCornerLast->points[j].z - pointSel.z) *
+                                    (laserCloudCornerLast->points[j].z - pointSel.z);
+
+            if (pointSqDis < minPointSqDis2)
             {
-                printf("unsync messeage!");
-                ROS_BREAK();
+                // find nearer point
+                minPointSqDis2 = pointSqDis;
+                minPointInd2 = j;
             }
+        }
 
-            mBuf.lock();
-            cornerPointsSharp->clear();
-            pcl::fromROSMsg(*cornerSharpBuf.front(), *cornerPointsSharp);
-            cornerSharpBuf.pop();
+        // search in the direction of decreasing scan line
+        for (int j = closestPointInd - 1; j >= 0; --j)
+        {
+            // if in the same scan line, continue
+            if (int(laserCloudCornerLast->points[j].intensity) >= closestPointScanID)
+                continue;
+
+            // if not in nearby scans, end the loop
+            if (int(laserCloudCornerLast->points[j].intensity) < (closestPointScanID - NEARBY_SCAN))
+                break;
+
+            double pointSqDis = (laserCloudCornerLast->points[j].x - pointSel.x) *
+                                    (laserCloudCornerLast->points[j].x - pointSel.x) +
+                                (laserCloudCornerLast->points[j].y - pointSel.y) *
+                                    (laserCloudCornerLast->points[j].y - pointSel.y) +
+                                (laserCloudCornerLast->points[j].z - pointSel.z) *
+                                    (laserCloudCornerLast->points[j].z - pointSel.z);
+
+            if (pointSqDis < minPointSqDis2)
+            {
+                // find nearer point
+                minPointSqDis2 = pointSqDis;
+                minPointInd2 = j;
+            }
+        }
+    }
+}
 
-            cornerPointsLessSharp->clear();
-            pcl::fromROSMsg(*cornerLessSharpBuf.front(), *cornerPointsLessSharp);
-            cornerLessSharpBuf.pop();
+// Nearest point to the flat point i among the last flat points, the nearest one
+// on the same or a lower scan line and the nearest one on a higher scan line,
+// -1 if there is none.
+void LaserOdometry::findPlaneCorrespondence(int i, int &closestPointInd, int &minPointInd2, int &minPointInd3)
+{
+    pcl::PointXYZI pointSel;
+    TransformToStart(&(surfPointsFlat->points[i]), &pointSel);
 
-            surfPointsFlat->clear();
-            pcl::fromROSMsg(*surfFlatBuf.front(), *surfPointsFlat);
-            surfFlatBuf.pop();
+    if (PROJECTIVE_ASSOCIATION)
+    {
+        const int nearbyScans = int(NEARBY_SCAN);
+        int scanID = int(pointSel.intensity);
+        closestPointInd = projectiveSurfLast.nearest(pointSel, scanID - nearbyScans, scanID + nearbyScans, -1, -1,
+                                                     DISTANCE_SQ_THRESHOLD);
+        minPointInd2 = -1;
+        minPointInd3 = -1;
+        if (closestPointInd >= 0)
+        {
+            // the second point on the scan line of the closest, the third on another one
+            int closestPointScanID = int(laserCloudSurfLast->points[closestPointInd].intensity);
+            minPointInd2 = projectiveSurfLast.nearest(pointSel, closestPointScanID, closestPointScanID, -1,
+                                                      closestPointInd, DISTANCE_SQ_THRESHOLD);
+            minPointInd3 = projectiveSurfLast.nearest(pointSel, closestPointScanID - nearbyScans,
+                                                      closestPointScanID + nearbyScans, closestPointScanID, -1,
+                                                      DISTANCE_SQ_THRESHOLD);
+        }
+        return;
+    }
+
+    std::vector<int> pointSearchInd;
+    std::vector<float> pointSearchSqDis;
+    kdtreeSurfLast->nearestKSearch(pointSel, 1, pointSearchInd, pointSearchSqDis);
 
-            surfPointsLessFlat->clear();
-            pcl::fromROSMsg(*surfLessFlatBuf.front(), *surfPointsLessFlat);
-            surfLessFlatBuf.pop();
+    closestPointInd = -1;
+    minPointInd2 = -1;
+    minPointInd3 = -1;
+    if (pointSearchSqDis[0] < DISTANCE_SQ_THRESHOLD)
+    {
+        closestPointInd = pointSearchInd[0];
 
-            laserCloudFullRes->clear();
-            pcl::fromROSMsg(*fullPointsBuf.front(), *laserCloudFullRes);
-            fullPointsBuf.pop();
-            mBuf.unlock();
+        // get closest point's scan ID
+        int closestPointScanID = int(laserCloudSurfLast->points[closestPointInd].intensity);
+        double minPointSqDis2 = DISTANCE_SQ_THRESHOLD, minPointSqDis3 = DISTANCE_SQ_THRESHOLD;
 
-            TicToc t_whole;
-            // initializing
-            if (!systemInited)
+        // search in the direction of increasing scan line
+        for (int j = closestPointInd + 1; j < (int)laserCloudSurfLast->points.size(); ++j)
+        {
+            // if not in nearby scans, end the loop
+            if (int(laserCloudSurfLast->points[j].intensity) > (closestPointScanID + NEARBY_SCAN))
+                break;
+
+            double pointSqDis = (laserCloudSurfLast->points[j].x - pointSel.x) *
+                                    (laserCloudSurfLast->points[j].x - pointSel.x) +
+                                (laserCloudSurfLast->points[j].y - pointSel.y) *
+                                    (laserCloudSurfLast->points[j].y - pointSel.y) +
+                                (laserCloudSurfLast->points[j].z - pointSel.z) *
+                                    (laserCloudSurfLast->points[j].z - pointSel.z);
+
+            // if in the same or lower scan line
+            if (int(laserCloudSurfLast->points[j].intensity) <= closestPointScanID && pointSqDis < minPointSqDis2)
+            {
+                minPointSqDis2 = pointSqDis;
+                minPointInd2 = j;
+            }
+            // if in the higher scan line
+            else if (int(laserCloudSurfLast->points[j].intensity) > closestPointScanID && pointSqDis < minPointSqDis3)
             {
-                systemInited = true;
-                std::cout << "Initialization finished \n";
+                minPointSqDis3 = pointSqDis;
+                minPointInd3 = j;
+            }
+        }
+
+        // search in the direction of decreasing scan line
+        for (int j = closestPointInd - 1; j >= 0; --j)
+        {
+            // if not in nearby scans, end the loop
+            if (int(laserCloudSurfLast->points[j].intensity) < (closestPointScanID - NEARBY_SCAN))
+                break;
+
+            double pointSqDis = (laserCloudSurfLast->points[j].x - pointSel.x) *
+                                    (laserCloudSurfLast->points[j].x - pointSel.x) +
+                                (laserCloudSurfLast->points[j].y - pointSel.y) *
+                                    (laserCloudSurfLast->points[j].y - pointSel.y) +
+                                (laserCloudSurfLast->points[j].z - pointSel.z) *
+                                    (laserCloudSurfLast->points[j].z - pointSel.z);
+
+            // if in the same or higher scan line
+            if (int(laserCloudSurfLast->points[j].intensity) >= closestPointScanID && pointSqDis < minPointSqDis2)
+            {
+                minPointSqDis2 = pointSqDis;
+                minPointInd2 = j;
+            }
+            else if (int(laserCloudSurfLast->points[j].intensity) < closestPointScanID && pointSqDis < minPointSqDis3)
+            {
+                // find nearer point
+                minPointSqDis3 = pointSqDis;
+                minPointInd3 = j;
+            }
+        }
+    }
+}
+
+void LaserOdometry::forEachFeature(int num, const std::function<void(int)> &body)
+{
+    if (associationPool != nullptr && associationPool->size() > 0)
+    {
+        associationPool->parallelFor(0, num, body);
+    }
+    else
+    {
+        for (int i = 0; i < num; i++)
+            body(i);
+    }
+}
+
+// matches the next complete sweep against the last one, false if none is buffered
+bool LaserOdometry::processFrame()
+{
+    if (!(USE_FEATURE_BUNDLE ? fetchFeatureBundle() : fetchFeatureClouds()))
+        return false;
+
+    TicToc t_whole;
+    // initializing
+    if (!systemInited)
+    {
+        systemInited = true;
+        motionPredictor.reset(timeLaserCloudFullRes);
+        std::cout << "Initialization finished \n";
+    }
+    else
+    {
+        int cornerPointsSharpNum = cornerPointsSharp->points.size();
+        int surfPointsFlatNum = surfPointsFlat->points.size();
+
+        // the motion starts from the prediction, else from the last sweep,
+        // the rotation from the imu if there is one
+        Eigen::Quaterniond q_predicted;
+        Eigen::Vector3d t_predicted;
+        MotionPredictor::Matrix6d predictionCovariance;
+        if (motionPredictor.predict(timeLaserCloudFullRes, q_predicted, t_predicted, predictionCovariance))
+        {
+            q_last_curr = q_predicted;
+            t_last_curr = t_predicted;
+            printf("predicted motion sigma rotation %f translation %f \n",
+                   std::sqrt(predictionCovariance.topLeftCorner<3, 3>().trace()),
+                   std::sqrt(predictionCovariance.bottomRightCorner<3, 3>().trace()));
+        }
+        Eigen::Quaterniond q_imu;
+        if (USE_IMU && fetchImuRotation(timeLaserCloudFullRes, q_imu))
+            q_last_curr = q_imu;
+
+        TicToc t_opt;
+        for (size_t opti_counter = 0; opti_counter < 2; ++opti_counter)
+        {
+            Eigen::Quaterniond q_round = q_last_curr;
+            Eigen::Vector3d t_round = t_last_curr;
+            sweepMotion.set(q_last_curr, t_last_curr, DISTORTION);
+            corner_correspondence = 0;
+            plane_correspondence = 0;
+
+            ceres::LossFunction *loss_function = NULL;
+            LidarBatchFactor *batch_factor = NULL;
+            std::unique_ptr<ceres::Problem> problem;
+            if (scanMatchingBackend == ScanMatchingBackend::GaussNewton)
+            {
+                // no problem to build, the terms are solved directly
+                batch_factor = gaussNewtonTerms.get();
+                batch_factor->clear();
             }
             else
             {
-                int cornerPointsSharpNum = cornerPointsSharp->points.size();
-                int surfPointsFlatNum = surfPointsFlat->points.size();
+                if (scanMatchingBackend == ScanMatchingBackend::Batched)
+                {
+                    batch_factor = new LidarBatchFactor(0.1);
+                    batch_factor->reserve(cornerPointsSharpNum, surfPointsFlatNum);
+                }
+                else
+                {
+                    loss_function = new ceres::HuberLoss(0.1);
+                }
+                ceres::LocalParameterization *q_parameterization;
+                if (scanMatchingBackend != ScanMatchingBackend::AutoDiff)
+                    q_parameterization = new RightQuaternionParameterization();
+                else
+                    q_parameterization = new ceres::EigenQuaternionParameterization();
+                ceres::Problem::Options problem_options;
+
+                problem.reset(new ceres::Problem(problem_options));
+                problem->AddParameterBlock(para_q, 4, q_parameterization);
+                problem->AddParameterBlock(para_t, 3);
+            }
 
-                TicToc t_opt;
-                for (size_t opti_counter = 0; opti_counter < 2; ++opti_counter)
+            TicToc t_data;
+            // search the correspondences of all features in parallel, every
+            // feature writes its own slot only, then add the residuals in
+            // feature order, so the problem does not depend on the threads
+            cornerCorrespondences.resize(cornerPointsSharpNum);
+            forEachFeature(cornerPointsSharpNum, [this](int i) {
+                Correspondence &c = cornerCorrespondences[i];
+                findCornerCorrespondence(i, c.a, c.b);
+            });
+            surfCorrespondences.resize(surfPointsFlatNum);
+            forEachFeature(surfPointsFlatNum, [this](int i) {
+                Correspondence &c = surfCorrespondences[i];
+                findPlaneCorrespondence(i, c.a, c.b, c.c);
+            });
+
+            // add the correspondence for corner features
+            for (int i = 0; i < cornerPointsSharpNum; ++i)
+            {
+                int closestPointInd = cornerCorrespondences[i].a;
+                int minPointInd2 = cornerCorrespondences[i].b;
+                if (minPointInd2 >= 0) // both closestPointInd and minPointInd2 is valid
                 {
-                    corner_correspondence = 0;
-                    plane_correspondence = 0;
-
-                    //ceres::LossFunction *loss_function = NULL;
-                    ceres::LossFunction *loss_function = new ceres::HuberLoss(0.1);
-                    ceres::LocalParameterization *q_parameterization =
-                        new ceres::EigenQuaternionParameterization();
-                    ceres::Problem::Options problem_options;
-
-                    ceres::Problem problem(problem_options);
-                    problem.AddParameterBlock(para_q, 4, q_parameterization);
-                    problem.AddParameterBlock(para_t, 3);
-
-                    pcl::PointXYZI pointSel;
-                    std::vector<int> pointSearchInd;
-                    std::vector<float> pointSearchSqDis;
-
-                    TicToc t_data;
-                    // find correspondence for corner features
-                    for (int i = 0; i < cornerPointsSharpNum; ++i)
+                    Eigen::Vector3d curr_point(cornerPointsSharp->points[i].x,
+                                               cornerPointsSharp->points[i].y,
+                                               cornerPointsSharp->points[i].z);
+                    Eigen::Vector3d last_point_a(laserCloudCornerLast->points[closestPointInd].x,
+                                                 laserCloudCornerLast->points[closestPointInd].y,
+                                                 laserCloudCornerLast->points[closestPointInd].z);
+                    Eigen::Vector3d last_point_b(laserCloudCornerLast->points[minPointInd2].x,
+                                                 laserCloudCornerLast->points[minPointInd2].y,
+                                                 laserCloudCornerLast->points[minPointInd2].z);
+
+                    double s;
+                    if (DISTORTION)
+                        s = (cornerPointsSharp->points[i].intensity - int(cornerPointsSharp->points[i].intensity)) / SCAN_PERIOD;
+                    else
+                        s = 1.0;
+                    if (batch_factor)
                     {
-                        TransformToStart(&(cornerPointsSharp->points[i]), &pointSel);
-                        kdtreeCornerLast->nearestKSearch(pointSel, 1, pointSearchInd, pointSearchSqDis);
-
-                        int closestPointInd = -1, minPointInd2 = -1;
-                        if (pointSearchSqDis[0] < DISTANCE_SQ_THRESHOLD)
-                        {
-                            closestPointInd = pointSearchInd[0];
-                            int closestPointScanID = int(laserCloudCornerLast->points[closestPointInd].intensity);
-
-                            double minPointSqDis2 = DISTANCE_SQ_THRESHOLD;
-                            // search in the direction of increasing scan line
-                            for (int j = closestPointInd + 1; j < (int)laserCloudCornerLast->points.size(); ++j)
-                            {
-                                // if in the same scan line, continue
-                                if (int(laserCloudCornerLast->points[j].intensity) <= closestPointScanID)
-                                    continue;
-
-                                // if not in nearby scans, end the loop
-                                if (int(laserCloudCornerLast->points[j].intensity) > (closestPointScanID + NEARBY_SCAN))
-                                    break;
-
-                                double pointSqDis = (laserCloudCornerLast->points[j].x - pointSel.x) *
-                                                        (laserCloudCornerLast->points[j].x - pointSel.x) +
-                                                    (laserCloudCornerLast->points[j].y - pointSel.y) *
-                                                        (laserCloudCornerLast->points[j].y - pointSel.y) +
-                                                    (laserCloudCornerLast->points[j].z - pointSel.z) *
-                                                        (laserCloudCornerLast->points[j].z - pointSel.z);
-
-                                if (pointSqDis < minPointSqDis2)
-                                {
-                                    // find nearer point
-                                    minPointSqDis2 = pointSqDis;
-                                    minPointInd2 = j;
-                                }
-                            }
-
-                            // search in the direction of decreasing scan line
-                            for (int j = closestPointInd - 1; j >= 0; --j)
-                            {
-                                // if in the same scan line, continue
-                                if (int(laserCloudCornerLast->points[j].intensity) >= closestPointScanID)
-                                    continue;
-
-                                // if not in nearby scans, end the loop
-                                if (int(laserCloudCornerLast->points[j].intensity) < (closestPointScanID - NEARBY_SCAN))
-                                    break;
-
-                                double pointSqDis = (laserCloudCornerLast->points[j].x - pointSel.x) *
-                                                        (laserCloudCornerLast->points[j].x - pointSel.x) +
-                                                    (laserCloudCornerLast->points[j].y - pointSel.y) *
-                                                        (laserCloudCornerLast->points[j].y - pointSel.y) +
-                                                    (laserCloudCornerLast->points[j].z - pointSel.z) *
-                                                        (laserCloudCornerLast->points[j].z - pointSel.z);
-
-                                if (pointSqDis < minPointSqDis2)
-                                {
-                                    // find nearer point
-                                    minPointSqDis2 = pointSqDis;
-                                    minPointInd2 = j;
-                                }
-                            }
-                        }
-                        if (minPointInd2 >= 0) // both closestPointInd and minPointInd2 is valid
-                        {
-                            Eigen::Vector3d curr_point(cornerPointsSharp->points[i].x,
-                                                       cornerPointsSharp->points[i].y,
-                                                       cornerPointsSharp->points[i].z);
-                            Eigen::Vector3d last_point_a(laserCloudCornerLast->points[closestPointInd].x,
-                                                         laserCloudCornerLast->points[closestPointInd].y,
-                                                         laserCloudCornerLast->points[closestPointInd].z);
-                            Eigen::Vector3d last_point_b(laserCloudCornerLast->points[minPointInd2].x,
-                                                         laserCloudCornerLast->points[minPointInd2].y,
-                                                         laserCloudCornerLast->points[minPointInd2].z);
-
-                            double s;
-                            if (DISTORTION)
-                                s = (cornerPointsSharp->points[i].intensity - int(cornerPointsSharp->points[i].intensity)) / SCAN_PERIOD;
-                            else
-                                s = 1.0;
-                            ceres::CostFunction *cost_function = LidarEdgeFactor::Create(curr_point, last_point_a, last_point_b, s);
-                            problem.AddResidualBlock(cost_function, loss_function, para_q, para_t);
-                            corner_correspondence++;
-                        }
+                        batch_factor->addEdge(curr_point, last_point_a, last_point_b, s);
                     }
-
-                    // find correspondence for plane features
-                    for (int i = 0; i < surfPointsFlatNum; ++i)
+                    else
                     {
-                        TransformToStart(&(surfPointsFlat->points[i]), &pointSel);
-                        kdtreeSurfLast->nearestKSearch(pointSel, 1, pointSearchInd, pointSearchSqDis);
-
-                        int closestPointInd = -1, minPointInd2 = -1, minPointInd3 = -1;
-                        if (pointSearchSqDis[0] < DISTANCE_SQ_THRESHOLD)
-                        {
-                            closestPointInd = pointSearchInd[0];
-
-                            // get closest point's scan ID
-                            int closestPointScanID = int(laserCloudSurfLast->points[closestPointInd].intensity);
-                            double minPointSqDis2 = DISTANCE_SQ_THRESHOLD, minPointSqDis3 = DISTANCE_SQ_THRESHOLD;
-
-                            // search in the direction of increasing scan line
-                            for (int j = closestPointInd + 1; j < (int)laserCloudSurfLast->points.size(); ++j)
-                            {
-                                // if not in nearby scans, end the loop
-                                if (int(laserCloudSurfLast->points[j].intensity) > (closestPointScanID + NEARBY_SCAN))
-                                    break;
-
-                                double pointSqDis = (laserCloudSurfLast->points[j].x - pointSel.x) *
-                                                        (laserCloudSurfLast->points[j].x - pointSel.x) +
-                                                    (laserCloudSurfLast->points[j].y - pointSel.y) *
-                                                        (laserCloudSurfLast->points[j].y - pointSel.y) +
-                                                    (laserCloudSurfLast->points[j].z - pointSel.z) *
-                                                        (laserCloudSurfLast->points[j].z - pointSel.z);
-
-                                // if in the same or lower scan line
-                                if (int(laserCloudSurfLast->points[j].intensity) <= closestPointScanID && pointSqDis < minPointSqDis2)
-                                {
-                                    minPointSqDis2 = pointSqDis;
-                                    minPointInd2 = j;
-                                }
-                                // if in the higher scan line
-                                else if (int(laserCloudSurfLast->points[j].intensity) > closestPointScanID && pointSqDis < minPointSqDis3)
-                                {
-                                    minPointSqDis3 = pointSqDis;
-                                    minPointInd3 = j;
-                                }
-                            }
-
-                            // search in the direction of decreasing scan line
-                            for (int j = closestPointInd - 1; j >= 0; --j)
-                            {
-                                // if not in nearby scans, end the loop
-                                if (int(laserCloudSurfLast->points[j].intensity) < (closestPointScanID - NEARBY_SCAN))
-                                    break;
-
-                                double pointSqDis = (laserCloudSurfLast->points[j].x - pointSel.x) *
-                                                        (laserCloudSurfLast->points[j].x - pointSel.x) +
-                                                    (laserCloudSurfLast->points[j].y - pointSel.y) *
-                                                        (laserCloudSurfLast->points[j].y - pointSel.y) +
-                                                    (laserCloudSurfLast->points[j].z - pointSel.z) *
-                                                        (laserCloudSurfLast->points[j].z - pointSel.z);
-
-                                // if in the same or higher scan line
-                                if (int(laserCloudSurfLast->points[j].intensity) >= closestPointScanID && pointSqDis < minPointSqDis2)
-                                {
-                                    minPointSqDis2 = pointSqDis;
-                                    minPointInd2 = j;
-                                }
-                                else if (int(laserCloudSurfLast->points[j].intensity) < closestPointScanID && pointSqDis < minPointSqDis3)
-                                {
-                                    // find nearer point
-                                    minPointSqDis3 = pointSqDis;
-                                    minPointInd3 = j;
-                                }
-                            }
-
-                            if (minPointInd2 >= 0 && minPointInd3 >= 0)
-                            {
-
-                                Eigen::Vector3d curr_point(surfPointsFlat->points[i].x,
-                                                            surfPointsFlat->points[i].y,
-                                                            surfPointsFlat->points[i].z);
-                                Eigen::Vector3d last_point_a(laserCloudSurfLast->points[closestPointInd].x,
-                                                                laserCloudSurfLast->points[closestPointInd].y,
-                                                                laserCloudSurfLast->points[closestPointInd].z);
-                                Eigen::Vector3d last_point_b(laserCloudSurfLast->points[minPointInd2].x,
-                                                                laserCloudSurfLast->points[minPointInd2].y,
-                                                                laserCloudSurfLast->points[minPointInd2].z);
-                                Eigen::Vector3d last_point_c(laserCloudSurfLast->points[minPointInd3].x,
-                                                                laserCloudSurfLast->points[minPointInd3].y,
-                                                                laserCloudSurfLast->points[minPointInd3].z);
-
-                                double s;
-                                if (DISTORTION)
-                                    s = (surfPointsFlat->points[i].intensity - int(surfPointsFlat->points[i].intensity)) / SCAN_PERIOD;
-                                else
-                                    s = 1.0;
-                                ceres::CostFunction *cost_function = LidarPlaneFactor::Create(curr_point, last_point_a, last_point_b, last_point_c, s);
-                                problem.AddResidualBlock(cost_function, loss_function, para_q, para_t);
-                                plane_correspondence++;
-                            }
-                        }
+                        ceres::CostFunction *cost_function = scanMatchingBackend == ScanMatchingBackend::Analytic
+                                                                 ? LidarEdgeAnalyticFactor::Create(curr_point, last_point_a, last_point_b, s)
+                                                                 : LidarEdgeFactor::Create(curr_point, last_point_a, last_point_b, s);
+                        problem->AddResidualBlock(cost_function, loss_function, para_q, para_t);
                     }
+                    corner_correspondence++;
+                }
+            }
 
-                    //printf("coner_correspondance %d, plane_correspondence %d \n", corner_correspondence, plane_correspondence);
-                    printf("data association time %f ms \n", t_data.toc());
-
-                    if ((corner_correspondence + plane_correspondence) < 10)
+            // add the correspondence for plane features
+            for (int i = 0; i < surfPointsFlatNum; ++i)
+            {
+                int closestPointInd = surfCorrespondences[i].a;
+                int minPointInd2 = surfCorrespondences[i].b;
+                int minPointInd3 = surfCorrespondences[i].c;
+                if (minPointInd2 >= 0 && minPointInd3 >= 0)
+                {
+                    Eigen::Vector3d curr_point(surfPointsFlat->points[i].x,
+                                               surfPointsFlat->points[i].y,
+                                               surfPointsFlat->points[i].z);
+                    Eigen::Vector3d last_point_a(laserCloudSurfLast->points[closestPointInd].x,
+                                                 laserCloudSurfLast->points[closestPointInd].y,
+                                                 laserCloudSurfLast->points[closestPointInd].z);
+                    Eigen::Vector3d last_point_b(laserCloudSurfLast->points[minPointInd2].x,
+                                                 laserCloudSurfLast->points[minPointInd2].y,
+                                                 laserCloudSurfLast->points[minPointInd2].z);
+                    Eigen::Vector3d last_point_c(laserCloudSurfLast->points[minPointInd3].x,
+                                                 laserCloudSurfLast->points[minPointInd3].y,
+                                                 laserCloudSurfLast->points[minPointInd3].z);
+
+                    double s;
+                    if (DISTORTION)
+                        s = (surfPointsFlat->points[i].intensity - int(surfPointsFlat->points[i].intensity)) / SCAN_PERIOD;
+                    else
+                        s = 1.0;
+                    if (batch_factor)
                     {
-                        printf("less correspondence! *************************************************\n");
+                        batch_factor->addPlane(curr_point, last_point_a, last_point_b, last_point_c, s);
                     }
-
-                    TicToc t_solver;
-                    ceres::Solver::Options options;
-                    options.linear_solver_type = ceres::DENSE_QR;
-                    options.max_num_iterations = 4;
-                    options.minimizer_progress_to_stdout = false;
-                    ceres::Solver::Summary summary;
-                    ceres::Solve(options, &problem, &summary);
-                    printf("solver time %f ms \n", t_solver.toc());
+                    else
+                    {
+                        ceres::CostFunction *cost_function = scanMatchingBackend == ScanMatchingBackend::Analytic
+                                                                 ? LidarPlaneAnalyticFactor::Create(curr_point, last_point_a, last_point_b, last_point_c, s)
+                                                                 : LidarPlaneFactor::Create(curr_point, last_point_a, last_point_b, last_point_c, s);
+                        problem->AddResidualBlock(cost_function, loss_function, para_q, para_t);
+                    }
+                    plane_correspondence++;
                 }
-                printf("optimization twice time %f \n", t_opt.toc());
-
-                t_w_curr = t_w_curr + q_w_curr * t_last_curr;
-                q_w_curr = q_w_curr * q_last_curr;
             }
 
-            TicToc t_pub;
-
-            // publish odometry
-            nav_msgs::Odometry laserOdometry;
-            laserOdometry.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-            laserOdometry.child_frame_id = std::string(getenv("DRONE_NAME")) + "/laser_odom";
-            laserOdometry.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-            laserOdometry.pose.pose.orientation.x = q_w_curr.x();
-            laserOdometry.pose.pose.orientation.y = q_w_curr.y();
-            laserOdometry.pose.pose.orientation.z = q_w_curr.z();
-            laserOdometry.pose.pose.orientation.w = q_w_curr.w();
-            laserOdometry.pose.pose.position.x = t_w_curr.x();
-            laserOdometry.pose.pose.position.y = t_w_curr.y();
-            laserOdometry.pose.pose.position.z = t_w_curr.z();
-            pubLaserOdometry.publish(laserOdometry);
-
-            geometry_msgs::PoseStamped laserPose;
-            laserPose.header = laserOdometry.header;
-            laserPose.pose = laserOdometry.pose.pose;
-            laserPath.header.stamp = laserOdometry.header.stamp;
-            laserPath.poses.push_back(laserPose);
-            laserPath.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-            pubLaserPath.publish(laserPath);
-
-            // transform corner features and plane features to the scan end point
-            if (0)
+            //printf("coner_correspondance %d, plane_correspondence %d \n", corner_correspondence, plane_correspondence);
+            printf("data association time %f ms \n", t_data.toc());
+
+            if ((corner_correspondence + plane_correspondence) < 10)
             {
-                int cornerPointsLessSharpNum = cornerPointsLessSharp->points.size();
-                for (int i = 0; i < cornerPointsLessSharpNum; i++)
-                {
-                    TransformToEnd(&cornerPointsLessSharp->points[i], &cornerPointsLessSharp->points[i]);
-                }
+                printf("less correspondence! *************************************************\n");
+            }
 
-                int surfPointsLessFlatNum = surfPointsLessFlat->points.size();
-                for (int i = 0; i < surfPointsLessFlatNum; i++)
+            TicToc t_solver;
+            if (problem)
+            {
+                // the problem owns the block once it is added
+                if (batch_factor && batch_factor->numTerms() > 0)
+                    problem->AddResidualBlock(batch_factor, NULL, para_q, para_t);
+                else
+                    delete batch_factor;
+
+                ceres::Solver::Options options;
+                options.linear_solver_type = ceres::DENSE_QR;
+                options.max_num_iterations = 4;
+                options.minimizer_progress_to_stdout = false;
+                PoseConvergenceCallback convergence(para_q, para_t, convergenceTolerance);
+                if (convergenceTolerance.rotation > 0 && convergenceTolerance.translation > 0)
                 {
-                    TransformToEnd(&surfPointsLessFlat->points[i], &surfPointsLessFlat->points[i]);
+                    options.update_state_every_iteration = true;
+                    options.callbacks.push_back(&convergence);
                 }
+                ceres::Solver::Summary summary;
+                ceres::Solve(options, problem.get(), &summary);
+            }
+            else
+            {
+                solvePoseGaussNewton(*batch_factor, 4, para_q, para_t, convergenceTolerance);
+            }
+            printf("solver time %f ms \n", t_solver.toc());
 
-                int laserCloudFullResNum = laserCloudFullRes->points.size();
-                for (int i = 0; i < laserCloudFullResNum; i++)
-                {
-                    TransformToEnd(&laserCloudFullRes->points[i], &laserCloudFullRes->points[i]);
-                }
+            // the pose barely moved, so associating again would find the same correspondences
+            if (convergenceTolerance.reached(q_last_curr.angularDistance(q_round), (t_last_curr - t_round).norm()))
+            {
+                printf("converged in association round %d \n", int(opti_counter) + 1);
+                break;
             }
+        }
+        printf("optimization twice time %f \n", t_opt.toc());
 
-            pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
-            cornerPointsLessSharp = laserCloudCornerLast;
-            laserCloudCornerLast = laserCloudTemp;
+        motionPredictor.update(timeLaserCloudFullRes, q_last_curr, t_last_curr);
 
-            laserCloudTemp = surfPointsLessFlat;
-            surfPointsLessFlat = laserCloudSurfLast;
-            laserCloudSurfLast = laserCloudTemp;
+        t_w_curr = t_w_curr + q_w_curr * t_last_curr;
+        q_w_curr = q_w_curr * q_last_curr;
+    }
+
+    TicToc t_pub;
+
+    // publish odometry
+    nav_msgs::Odometry laserOdometry;
+    laserOdometry.header.frame_id = droneName + "/camera_init";
+    laserOdometry.child_frame_id = droneName + "/laser_odom";
+    laserOdometry.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
+    laserOdometry.pose.pose.orientation.x = q_w_curr.x();
+    laserOdometry.pose.pose.orientation.y = q_w_curr.y();
+    laserOdometry.pose.pose.orientation.z = q_w_curr.z();
+    laserOdometry.pose.pose.orientation.w = q_w_curr.w();
+    laserOdometry.pose.pose.position.x = t_w_curr.x();
+    laserOdometry.pose.pose.position.y = t_w_curr.y();
+    laserOdometry.pose.pose.position.z = t_w_curr.z();
+    pubLaserOdometry.publish(laserOdometry);
+
+    geometry_msgs::PoseStamped laserPose;
+    laserPose.header = laserOdometry.header;
+    laserPose.pose = laserOdometry.pose.pose;
+    laserPath.publish(laserPose);
+
+    // transform corner features and plane features to the scan end point
+    if (DISTORTION)
+    {
+        sweepMotion.set(q_last_curr, t_last_curr, DISTORTION);
+        cornerPointsLessSharp = transformCloudToEnd(*cornerPointsLessSharp);
+        surfPointsLessFlat = transformCloudToEnd(*surfPointsLessFlat);
+        laserCloudFullRes = transformCloudToEnd(*laserCloudFullRes);
+    }
 
-            laserCloudCornerLastNum = laserCloudCornerLast->points.size();
-            laserCloudSurfLastNum = laserCloudSurfLast->points.size();
+    laserCloudCornerLast = cornerPointsLessSharp;
+    laserCloudSurfLast = surfPointsLessFlat;
 
-            // std::cout << "the size of corner last is " << laserCloudCornerLastNum << ", and the size of surf last is " << laserCloudSurfLastNum << '\n';
+    laserCloudCornerLastNum = laserCloudCornerLast->points.size();
+    laserCloudSurfLastNum = laserCloudSurfLast->points.size();
 
-            kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
-            kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+    // std::cout << "the size of corner last is " << laserCloudCornerLastNum << ", and the size of surf last is " << laserCloudSurfLastNum << '\n';
 
-            if (frameCount % skipFrameNum == 0)
-            {
-                frameCount = 0;
-
-                sensor_msgs::PointCloud2 laserCloudCornerLast2;
-                pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-                laserCloudCornerLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-                laserCloudCornerLast2.header.frame_id = "/camera";
-                pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
-
-                sensor_msgs::PointCloud2 laserCloudSurfLast2;
-                pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-                laserCloudSurfLast2.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-                laserCloudSurfLast2.header.frame_id = "/camera";
-                pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
-
-                sensor_msgs::PointCloud2 laserCloudFullRes3;
-                pcl::toROSMsg(*laserCloudFullRes, laserCloudFullRes3);
-                laserCloudFullRes3.header.stamp = ros::Time().fromSec(timeSurfPointsLessFlat);
-                laserCloudFullRes3.header.frame_id = "/camera";
-                pubLaserCloudFullRes.publish(laserCloudFullRes3);
-            }
-            printf("publication time %f ms \n", t_pub.toc());
-            printf("whole laserOdometry time %f ms \n \n", t_whole.toc());
-            if(t_whole.toc() > 100)
-                ROS_WARN("odometry process over 100ms");
+    if (PROJECTIVE_ASSOCIATION)
+    {
+        projectiveCornerLast.setInputCloud(laserCloudCornerLast);
+        projectiveSurfLast.setInputCloud(laserCloudSurfLast);
+    }
+    else
+    {
+        kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
+        kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+    }
 
-            frameCount++;
-        }
-        rate.sleep();
+    if (frameCount % skipFrameNum == 0)
+    {
+        frameCount = 0;
+
+        // the clouds go on to laserMapping as they are, without a copy. They keep
+        // the stamp of the sweep and the frame scanRegistration published them
+        // in, which the bundle carries as well.
+        pubLaserCloudCornerLast.publish(laserCloudCornerLast);
+        pubLaserCloudSurfLast.publish(laserCloudSurfLast);
+        pubLaserCloudFullRes.publish(laserCloudFullRes);
     }
-    return 0;
+    printf("publication time %f ms \n", t_pub.toc());
+    printf("whole laserOdometry time %f ms \n \n", t_whole.toc());
+    if(t_whole.toc() > 100)
+        ROS_WARN("odometry process over 100ms");
+
+    frameCount++;
+    return true;
 }
\ No newline at end of file
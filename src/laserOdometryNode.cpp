@@ -0,0 +1,17 @@
+#include <string>
+#include <stdlib.h>     /* getenv */
+#include <ros/ros.h>
+
+#include "aloam_velodyne/laser_odometry.h"
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, std::string(getenv("DRONE_NAME")) + "_laserOdometry");
+    ros::NodeHandle nh;
+
+    LaserOdometry laserOdometry(nh, std::string(getenv("DRONE_NAME")));
+
+    ros::spin();
+
+    return 0;
+}
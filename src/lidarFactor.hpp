@@ -9,6 +9,8 @@
 #include <pcl/kdtree/kdtree_flann.h>
 #include <pcl_conversions/pcl_conversions.h>
 
+#include "aloam_velodyne/scan_matching.h"
+
 struct LidarEdgeFactor
 {
 	LidarEdgeFactor(Eigen::Vector3d curr_point_, Eigen::Vector3d last_point_a_,
@@ -169,4 +171,621 @@ struct LidarDistanceFactor
 
 	Eigen::Vector3d curr_point;
 	Eigen::Vector3d closed_point;
-};
\ No newline at end of file
+};
+
+// Exp of the rotation vector phi as a quaternion
+inline Eigen::Quaterniond quaternionExp(const Eigen::Vector3d &phi)
+{
+	double theta = phi.norm();
+	if (theta < 1e-10)
+		return Eigen::Quaterniond(1, 0.5 * phi.x(), 0.5 * phi.y(), 0.5 * phi.z());
+	return Eigen::Quaterniond(Eigen::AngleAxisd(theta, phi / theta));
+}
+
+// Quaternion block of the analytic factors, x holds x, y, z, w like for
+// ceres::EigenQuaternionParameterization, but a rotation update goes on the
+// right, q * Exp(delta). The analytic factors give their jacobian against
+// delta in the first three columns of the quaternion block and zero in the
+// last one, so the jacobian of this parameterization is [I; 0].
+class RightQuaternionParameterization : public ceres::LocalParameterization
+{
+public:
+	bool Plus(const double *x, const double *delta, double *x_plus_delta) const override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q(x);
+		Eigen::Map<const Eigen::Vector3d> phi(delta);
+		Eigen::Map<Eigen::Quaterniond> q_plus(x_plus_delta);
+		q_plus = (q * quaternionExp(phi)).normalized();
+		return true;
+	}
+
+	bool ComputeJacobian(const double *x, double *jacobian) const override
+	{
+		Eigen::Map<Eigen::Matrix<double, 4, 3, Eigen::RowMajor>> J(jacobian);
+		J.setZero();
+		J.topRows<3>().setIdentity();
+		return true;
+	}
+
+	int GlobalSize() const override { return 4; }
+	int LocalSize() const override { return 3; }
+};
+
+inline Eigen::Matrix3d skewSymmetric(const Eigen::Vector3d &v)
+{
+	Eigen::Matrix3d m;
+	m << 0, -v.z(), v.y(),
+		v.z(), 0, -v.x(),
+		-v.y(), v.x(), 0;
+	return m;
+}
+
+// Rotations of the fractions s of q, the same as q_identity.slerp(s, q) of
+// the autodiff factors, and dR_s, the right perturbation of R_s per right
+// perturbation of q. With phi = Log(q), q^s = Exp(s * phi) and
+// dR_s = s * Jr(s * phi) * Jr(phi)^-1, which is the identity for s = 1.
+// Everything that only depends on q is computed once.
+struct RotationInterpolation
+{
+	explicit RotationInterpolation(const Eigen::Quaterniond &q)
+	{
+		R = q.toRotationMatrix();
+
+		// slerp takes the shorter way, so does the angle in [0, pi]
+		Eigen::Quaterniond q_short = q.w() < 0 ? Eigen::Quaterniond(-q.w(), -q.x(), -q.y(), -q.z()) : q;
+		double sinHalf = q_short.vec().norm();
+		theta = 2 * std::atan2(sinHalf, q_short.w());
+		Eigen::Vector3d phi = sinHalf < 1e-10 ? Eigen::Vector3d(2 * q_short.vec()) : Eigen::Vector3d(theta / sinHalf * q_short.vec());
+
+		Phi = skewSymmetric(phi);
+		Phi2 = Phi * Phi;
+		if (theta < 1e-5)
+		{
+			JrInv = Eigen::Matrix3d::Identity() + 0.5 * Phi + Phi2 / 12.0;
+		}
+		else
+		{
+			JrInv = Eigen::Matrix3d::Identity() + 0.5 * Phi +
+					(1 / (theta * theta) - (1 + std::cos(theta)) / (2 * theta * std::sin(theta))) * Phi2;
+		}
+	}
+
+	void at(double s, Eigen::Matrix3d &R_s, Eigen::Matrix3d &dR_s) const
+	{
+		if (s == 1.0)
+		{
+			R_s = R;
+			dR_s.setIdentity();
+			return;
+		}
+
+		// Jr(s * phi) written with Phi = [phi]x, so the powers of s go into the coefficients
+		double theta_s = s * theta;
+		double theta2 = theta * theta;
+		Eigen::Matrix3d Jr_s;
+		if (theta < 1e-5)
+			R_s = Eigen::Matrix3d::Identity() + s * Phi + 0.5 * s * s * Phi2;
+		else
+			R_s = Eigen::Matrix3d::Identity() + std::sin(theta_s) / theta * Phi + (1 - std::cos(theta_s)) / theta2 * Phi2;
+		if (theta_s < 1e-5)
+			Jr_s = Eigen::Matrix3d::Identity() - 0.5 * s * Phi + s * s / 6.0 * Phi2;
+		else
+			Jr_s = Eigen::Matrix3d::Identity() - (1 - std::cos(theta_s)) / (s * theta2) * Phi +
+				   (theta_s - std::sin(theta_s)) / (s * theta2 * theta) * Phi2;
+		dR_s = s * Jr_s * JrInv;
+	}
+
+	Eigen::Matrix3d R, Phi, Phi2, JrInv;
+	double theta;
+};
+
+// LidarEdgeFactor with analytic jacobians, use with RightQuaternionParameterization.
+// The residual is linear in lp with the constant [b - a]x / |a - b|.
+class LidarEdgeAnalyticFactor : public ceres::SizedCostFunction<3, 4, 3>
+{
+public:
+	LidarEdgeAnalyticFactor(const Eigen::Vector3d &curr_point_, const Eigen::Vector3d &last_point_a_,
+							const Eigen::Vector3d &last_point_b_, double s_)
+		: curr_point(curr_point_), last_point_a(last_point_a_), s(s_)
+	{
+		dr_dlp = skewSymmetric(last_point_b_ - last_point_a_) / (last_point_a_ - last_point_b_).norm();
+	}
+
+	bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q_last_curr(parameters[0]);
+		Eigen::Map<const Eigen::Vector3d> t_last_curr(parameters[1]);
+
+		Eigen::Matrix3d R_s, dR_s;
+		RotationInterpolation(q_last_curr).at(s, R_s, dR_s);
+		Eigen::Vector3d lp = R_s * curr_point + s * t_last_curr;
+
+		Eigen::Map<Eigen::Vector3d> residual(residuals);
+		residual = dr_dlp * (lp - last_point_a);
+
+		if (jacobians)
+		{
+			if (jacobians[0])
+			{
+				Eigen::Map<Eigen::Matrix<double, 3, 4, Eigen::RowMajor>> J_q(jacobians[0]);
+				J_q.leftCols<3>() = -dr_dlp * R_s * skewSymmetric(curr_point) * dR_s;
+				J_q.col(3).setZero();
+			}
+			if (jacobians[1])
+			{
+				Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>> J_t(jacobians[1]);
+				J_t = s * dr_dlp;
+			}
+		}
+		return true;
+	}
+
+	static ceres::CostFunction *Create(const Eigen::Vector3d curr_point_, const Eigen::Vector3d last_point_a_,
+									   const Eigen::Vector3d last_point_b_, const double s_)
+	{
+		return new LidarEdgeAnalyticFactor(curr_point_, last_point_a_, last_point_b_, s_);
+	}
+
+	Eigen::Vector3d curr_point, last_point_a;
+	Eigen::Matrix3d dr_dlp;
+	double s;
+};
+
+// LidarPlaneFactor with analytic jacobians, use with RightQuaternionParameterization
+class LidarPlaneAnalyticFactor : public ceres::SizedCostFunction<1, 4, 3>
+{
+public:
+	LidarPlaneAnalyticFactor(const Eigen::Vector3d &curr_point_, const Eigen::Vector3d &last_point_j_,
+							 const Eigen::Vector3d &last_point_l_, const Eigen::Vector3d &last_point_m_, double s_)
+		: curr_point(curr_point_), last_point_j(last_point_j_), s(s_)
+	{
+		ljm_norm = (last_point_j_ - last_point_l_).cross(last_point_j_ - last_point_m_);
+		ljm_norm.normalize();
+	}
+
+	bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q_last_curr(parameters[0]);
+		Eigen::Map<const Eigen::Vector3d> t_last_curr(parameters[1]);
+
+		Eigen::Matrix3d R_s, dR_s;
+		RotationInterpolation(q_last_curr).at(s, R_s, dR_s);
+		Eigen::Vector3d lp = R_s * curr_point + s * t_last_curr;
+
+		residuals[0] = (lp - last_point_j).dot(ljm_norm);
+
+		if (jacobians)
+		{
+			if (jacobians[0])
+			{
+				Eigen::Map<Eigen::Matrix<double, 1, 4, Eigen::RowMajor>> J_q(jacobians[0]);
+				J_q.leftCols<3>() = -ljm_norm.transpose() * R_s * skewSymmetric(curr_point) * dR_s;
+				J_q(3) = 0;
+			}
+			if (jacobians[1])
+			{
+				Eigen::Map<Eigen::Matrix<double, 1, 3, Eigen::RowMajor>> J_t(jacobians[1]);
+				J_t = s * ljm_norm.transpose();
+			}
+		}
+		return true;
+	}
+
+	static ceres::CostFunction *Create(const Eigen::Vector3d curr_point_, const Eigen::Vector3d last_point_j_,
+									   const Eigen::Vector3d last_point_l_, const Eigen::Vector3d last_point_m_,
+									   const double s_)
+	{
+		return new LidarPlaneAnalyticFactor(curr_point_, last_point_j_, last_point_l_, last_point_m_, s_);
+	}
+
+	Eigen::Vector3d curr_point, last_point_j;
+	Eigen::Vector3d ljm_norm;
+	double s;
+};
+
+// LidarPlaneNormFactor with analytic jacobians, use with RightQuaternionParameterization
+class LidarPlaneNormAnalyticFactor : public ceres::SizedCostFunction<1, 4, 3>
+{
+public:
+	LidarPlaneNormAnalyticFactor(const Eigen::Vector3d &curr_point_, const Eigen::Vector3d &plane_unit_norm_,
+								 double negative_OA_dot_norm_)
+		: curr_point(curr_point_), plane_unit_norm(plane_unit_norm_), negative_OA_dot_norm(negative_OA_dot_norm_) {}
+
+	bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q_w_curr(parameters[0]);
+		Eigen::Map<const Eigen::Vector3d> t_w_curr(parameters[1]);
+
+		Eigen::Matrix3d R = q_w_curr.toRotationMatrix();
+		residuals[0] = plane_unit_norm.dot(R * curr_point + t_w_curr) + negative_OA_dot_norm;
+
+		if (jacobians)
+		{
+			if (jacobians[0])
+			{
+				Eigen::Map<Eigen::Matrix<double, 1, 4, Eigen::RowMajor>> J_q(jacobians[0]);
+				J_q.leftCols<3>() = -plane_unit_norm.transpose() * R * skewSymmetric(curr_point);
+				J_q(3) = 0;
+			}
+			if (jacobians[1])
+			{
+				Eigen::Map<Eigen::Matrix<double, 1, 3, Eigen::RowMajor>> J_t(jacobians[1]);
+				J_t = plane_unit_norm.transpose();
+			}
+		}
+		return true;
+	}
+
+	static ceres::CostFunction *Create(const Eigen::Vector3d curr_point_, const Eigen::Vector3d plane_unit_norm_,
+									   const double negative_OA_dot_norm_)
+	{
+		return new LidarPlaneNormAnalyticFactor(curr_point_, plane_unit_norm_, negative_OA_dot_norm_);
+	}
+
+	Eigen::Vector3d curr_point;
+	Eigen::Vector3d plane_unit_norm;
+	double negative_OA_dot_norm;
+};
+
+// All edge and plane residuals of one registration in a single cost
+// function, so ceres handles one residual block instead of one per
+// correspondence. The terms are kept in contiguous arrays and evaluated in
+// one loop, the jacobians are the analytic ones, so use it with
+// RightQuaternionParameterization. The Huber loss is applied inside and the
+// block goes into the problem without a loss function: every term is scaled
+// by w = sqrt(rho(|r|^2) / |r|^2), so half its squared norm is rho, and its
+// jacobian is the one of the scaled residual. Cost and gradient are the same
+// as for one block per term with a ceres::HuberLoss.
+class LidarBatchFactor : public ceres::CostFunction
+{
+public:
+	// huberDelta like for ceres::HuberLoss, 0 for no loss
+	explicit LidarBatchFactor(double huberDelta_) : huberDelta(huberDelta_)
+	{
+		mutable_parameter_block_sizes()->push_back(4);
+		mutable_parameter_block_sizes()->push_back(3);
+		set_num_residuals(0);
+	}
+
+	void reserve(int numEdges, int numPlanes)
+	{
+		edges.reserve(numEdges);
+		planes.reserve(numPlanes);
+	}
+
+	// same as LidarEdgeFactor
+	void addEdge(const Eigen::Vector3d &curr_point, const Eigen::Vector3d &last_point_a,
+				 const Eigen::Vector3d &last_point_b, double s)
+	{
+		EdgeTerm edge;
+		edge.curr_point = curr_point;
+		edge.last_point_a = last_point_a;
+		edge.dr_dlp = skewSymmetric(last_point_b - last_point_a) / (last_point_a - last_point_b).norm();
+		edge.s = s;
+		edges.push_back(edge);
+		set_num_residuals(num_residuals() + 3);
+	}
+
+	// same as LidarPlaneFactor
+	void addPlane(const Eigen::Vector3d &curr_point, const Eigen::Vector3d &last_point_j,
+				  const Eigen::Vector3d &last_point_l, const Eigen::Vector3d &last_point_m, double s)
+	{
+		Eigen::Vector3d ljm_norm = (last_point_j - last_point_l).cross(last_point_j - last_point_m);
+		ljm_norm.normalize();
+		addPlaneTerm(curr_point, ljm_norm, -ljm_norm.dot(last_point_j), s);
+	}
+
+	// same as LidarPlaneNormFactor
+	void addPlaneNorm(const Eigen::Vector3d &curr_point, const Eigen::Vector3d &plane_unit_norm,
+					  double negative_OA_dot_norm)
+	{
+		addPlaneTerm(curr_point, plane_unit_norm, negative_OA_dot_norm, 1.0);
+	}
+
+	int numTerms() const
+	{
+		return edges.size() + planes.size();
+	}
+
+	// drops the terms and keeps the memory for the next registration
+	void clear()
+	{
+		edges.clear();
+		planes.clear();
+		set_num_residuals(0);
+	}
+
+	bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q(parameters[0]);
+		Eigen::Map<const Eigen::Vector3d> t(parameters[1]);
+		ResidualWriter writer(*this, residuals, jacobians);
+		visitTerms(q, t, jacobians != NULL, writer);
+		return true;
+	}
+
+	// Huber weighted Gauss-Newton normal equations H * dx = -g at q, t. The
+	// weight of a term is rho'(|r|^2), as in iteratively reweighted least
+	// squares. dx is the rotation on the right, q * Exp(dx.head(3)), and the
+	// translation, t + dx.tail(3). Returns the cost at q, t.
+	double linearize(const Eigen::Quaterniond &q, const Eigen::Vector3d &t,
+					 Eigen::Matrix<double, 6, 6> &H, Eigen::Matrix<double, 6, 1> &g) const
+	{
+		NormalEquations normal(huberDelta, &H, &g);
+		visitTerms(q, t, true, normal);
+		return normal.cost;
+	}
+
+	// the cost at q, t, the same that ceres computes for the block
+	double cost(const Eigen::Quaterniond &q, const Eigen::Vector3d &t) const
+	{
+		NormalEquations normal(huberDelta, NULL, NULL);
+		visitTerms(q, t, false, normal);
+		return normal.cost;
+	}
+
+private:
+	struct EdgeTerm
+	{
+		Eigen::Vector3d curr_point, last_point_a;
+		Eigen::Matrix3d dr_dlp;
+		double s;
+	};
+
+	// r = norm . lp + offset
+	struct PlaneTerm
+	{
+		Eigen::Vector3d curr_point, norm;
+		double offset;
+		double s;
+	};
+
+	void addPlaneTerm(const Eigen::Vector3d &curr_point, const Eigen::Vector3d &norm, double offset, double s)
+	{
+		PlaneTerm plane;
+		plane.curr_point = curr_point;
+		plane.norm = norm;
+		plane.offset = offset;
+		plane.s = s;
+		planes.push_back(plane);
+		set_num_residuals(num_residuals() + 1);
+	}
+
+	// Calls visitor.term<N>(r, dr_dq, dr_dt) for every term at q, t, edges
+	// first. The jacobians are left unset without withJacobians.
+	template <typename Visitor>
+	void visitTerms(const Eigen::Quaterniond &q, const Eigen::Vector3d &t, bool withJacobians, Visitor &visitor) const
+	{
+		RotationInterpolation rotation(q);
+		Eigen::Matrix3d R_s, dR_s;
+
+		for (const EdgeTerm &edge : edges)
+		{
+			rotation.at(edge.s, R_s, dR_s);
+			Eigen::Vector3d lp = R_s * edge.curr_point + edge.s * t;
+			Eigen::Vector3d r = edge.dr_dlp * (lp - edge.last_point_a);
+
+			Eigen::Matrix3d dr_dq, dr_dt;
+			if (withJacobians)
+			{
+				dr_dq = -edge.dr_dlp * R_s * skewSymmetric(edge.curr_point) * dR_s;
+				dr_dt = edge.s * edge.dr_dlp;
+			}
+			visitor.template term<3>(r, dr_dq, dr_dt);
+		}
+
+		for (const PlaneTerm &plane : planes)
+		{
+			rotation.at(plane.s, R_s, dR_s);
+			Eigen::Vector3d lp = R_s * plane.curr_point + plane.s * t;
+			Eigen::Matrix<double, 1, 1> r;
+			r(0) = plane.norm.dot(lp) + plane.offset;
+
+			Eigen::Matrix<double, 1, 3> dr_dq, dr_dt;
+			if (withJacobians)
+			{
+				dr_dq = -plane.norm.transpose() * R_s * skewSymmetric(plane.curr_point) * dR_s;
+				dr_dt = plane.s * plane.norm.transpose();
+			}
+			visitor.template term<1>(r, dr_dq, dr_dt);
+		}
+	}
+
+	// Writes the residuals scaled by w and their jacobians w * J + 2 * dw/ds * r * r^T * J,
+	// s = |r|^2. Inside the quadratic part of the Huber loss w = 1.
+	struct ResidualWriter
+	{
+		ResidualWriter(const LidarBatchFactor &factor, double *residuals_, double **jacobians)
+			: huberDelta(factor.huberDelta), residuals(residuals_),
+			  J_q(jacobians ? jacobians[0] : NULL), J_t(jacobians ? jacobians[1] : NULL)
+		{
+		}
+
+		template <int N>
+		void term(const Eigen::Matrix<double, N, 1> &r, const Eigen::Matrix<double, N, 3> &dr_dq,
+				  const Eigen::Matrix<double, N, 3> &dr_dt)
+		{
+			double w = 1, dw = 0;
+			double sq = r.squaredNorm();
+			if (huberDelta > 0 && sq > huberDelta * huberDelta)
+			{
+				double norm = std::sqrt(sq);
+				double rho = 2 * huberDelta * norm - huberDelta * huberDelta;
+				double rho1 = huberDelta / norm;
+				double g = rho / sq;
+				w = std::sqrt(g);
+				dw = (rho1 * sq - rho) / (sq * sq) / (2 * w);
+			}
+
+			Eigen::Map<Eigen::Matrix<double, N, 1>>(residuals + row) = w * r;
+			if (J_q)
+			{
+				Eigen::Map<Eigen::Matrix<double, N, 4, Eigen::RowMajor>> J(J_q + 4 * row);
+				J.template leftCols<3>() = w * dr_dq + 2 * dw * r * (r.transpose() * dr_dq);
+				J.col(3).setZero();
+			}
+			if (J_t)
+			{
+				Eigen::Map<Eigen::Matrix<double, N, 3, Eigen::RowMajor>> J(J_t + 3 * row);
+				J = w * dr_dt + 2 * dw * r * (r.transpose() * dr_dt);
+			}
+			row += N;
+		}
+
+		double huberDelta;
+		double *residuals, *J_q, *J_t;
+		int row = 0;
+	};
+
+	// Sums the cost and, if H and g are given, the weighted normal equations
+	struct NormalEquations
+	{
+		NormalEquations(double huberDelta_, Eigen::Matrix<double, 6, 6> *H_, Eigen::Matrix<double, 6, 1> *g_)
+			: huberDelta(huberDelta_), H(H_), g(g_)
+		{
+			if (H)
+				H->setZero();
+			if (g)
+				g->setZero();
+		}
+
+		template <int N>
+		void term(const Eigen::Matrix<double, N, 1> &r, const Eigen::Matrix<double, N, 3> &dr_dq,
+				  const Eigen::Matrix<double, N, 3> &dr_dt)
+		{
+			double w = 1;
+			double sq = r.squaredNorm();
+			if (huberDelta > 0 && sq > huberDelta * huberDelta)
+			{
+				double norm = std::sqrt(sq);
+				cost += 0.5 * (2 * huberDelta * norm - huberDelta * huberDelta);
+				w = huberDelta / norm;
+			}
+			else
+			{
+				cost += 0.5 * sq;
+			}
+			if (!H)
+				return;
+
+			Eigen::Matrix<double, N, 6> J;
+			J << dr_dq, dr_dt;
+			*H += w * J.transpose() * J;
+			*g += w * J.transpose() * r;
+		}
+
+		double huberDelta;
+		Eigen::Matrix<double, 6, 6> *H;
+		Eigen::Matrix<double, 6, 1> *g;
+		double cost = 0;
+	};
+
+	double huberDelta;
+	std::vector<EdgeTerm> edges;
+	std::vector<PlaneTerm> planes;
+};
+
+// Minimizes the cost of the terms of a LidarBatchFactor over the pose q
+// (x, y, z, w) and t without ceres, for the registrations that only solve
+// for this one pose. Every iteration solves the 6x6 normal equations damped
+// by Levenberg-Marquardt, H + lambda * diag(H) with the diagonal clamped like
+// ceres does, and updates the rotation on the right. A step is also cut to
+// at most maxRotationStep and maxTranslationStep, so a direction the scene
+// does not constrain, like along a corridor, cannot run away. A step that
+// does not lower the cost is retried with more damping, a step within
+// tolerance is taken and ends the solve. Rejected steps count as iterations,
+// like in ceres. Returns the number of steps taken.
+inline int solvePoseGaussNewton(const LidarBatchFactor &terms, int maxIterations, double *q, double *t,
+								const PoseTolerance &tolerance = PoseTolerance())
+{
+	const double maxRotationStep = 0.2;
+	const double maxTranslationStep = 1.0;
+	const double minDiagonal = 1e-6, maxDiagonal = 1e32;
+
+	Eigen::Map<Eigen::Quaterniond> q_map(q);
+	Eigen::Map<Eigen::Vector3d> t_map(t);
+	if (terms.numTerms() == 0)
+		return 0;
+
+	Eigen::Matrix<double, 6, 6> H, H_new;
+	Eigen::Matrix<double, 6, 1> g, g_new;
+	double cost = terms.linearize(q_map, t_map, H, g);
+	double lambda = 1e-4, lambdaGrowth = 2;
+	int steps = 0;
+	for (int iteration = 0; iteration < maxIterations; iteration++)
+	{
+		Eigen::Matrix<double, 6, 6> A = H;
+		A.diagonal() += lambda * H.diagonal().cwiseMax(minDiagonal).cwiseMin(maxDiagonal);
+		Eigen::LDLT<Eigen::Matrix<double, 6, 6>> ldlt(A);
+		if (ldlt.info() != Eigen::Success)
+			break;
+		Eigen::Matrix<double, 6, 1> dx = -ldlt.solve(g);
+		if (!dx.allFinite())
+			break;
+
+		double scale = 1;
+		if (dx.head<3>().norm() > maxRotationStep)
+			scale = maxRotationStep / dx.head<3>().norm();
+		if (dx.tail<3>().norm() > maxTranslationStep)
+			scale = std::min(scale, maxTranslationStep / dx.tail<3>().norm());
+		dx *= scale;
+
+		Eigen::Quaterniond q_new = (q_map * quaternionExp(dx.head<3>())).normalized();
+		Eigen::Vector3d t_new = t_map + dx.tail<3>();
+		bool last = iteration + 1 == maxIterations || dx.squaredNorm() < 1e-16 ||
+					tolerance.reached(dx.head<3>().norm(), dx.tail<3>().norm());
+		double cost_new = last ? terms.cost(q_new, t_new) : terms.linearize(q_new, t_new, H_new, g_new);
+
+		// decrease of the cost against the one the linearization predicts
+		double predicted = -(g.dot(dx) + 0.5 * dx.dot(H * dx));
+		if (!(cost_new < cost) || predicted <= 0)
+		{
+			lambda *= lambdaGrowth;
+			lambdaGrowth *= 2;
+			continue;
+		}
+		double rho = (cost - cost_new) / predicted;
+		lambda *= std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * rho - 1.0, 3));
+		lambdaGrowth = 2;
+
+		q_map = q_new;
+		t_map = t_new;
+		cost = cost_new;
+		++steps;
+		if (last)
+			break;
+		H = H_new;
+		g = g_new;
+	}
+	return steps;
+}
+
+// Ends the iterations of ceres once a step moves the pose q (x, y, z, w), t
+// by less than the tolerance. Needs update_state_every_iteration, so that
+// the parameter blocks hold the pose of every iteration.
+class PoseConvergenceCallback : public ceres::IterationCallback
+{
+public:
+	PoseConvergenceCallback(const double *q_, const double *t_, const PoseTolerance &tolerance_)
+		: q(q_), t(t_), tolerance(tolerance_)
+	{
+		std::copy(q, q + 4, q_last);
+		std::copy(t, t + 3, t_last);
+	}
+
+	ceres::CallbackReturnType operator()(const ceres::IterationSummary &summary) override
+	{
+		Eigen::Map<const Eigen::Quaterniond> q_now(q), q_before(q_last);
+		Eigen::Map<const Eigen::Vector3d> t_now(t), t_before(t_last);
+		bool converged = summary.iteration > 0 && summary.step_is_successful &&
+						 tolerance.reached(q_now.angularDistance(q_before), (t_now - t_before).norm());
+		std::copy(q, q + 4, q_last);
+		std::copy(t, t + 3, t_last);
+		return converged ? ceres::SOLVER_TERMINATE_SUCCESSFULLY : ceres::SOLVER_CONTINUE;
+	}
+
+private:
+	const double *q, *t;
+	PoseTolerance tolerance;
+	double q_last[4], t_last[3];
+};
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <cmath>
+#include "aloam_velodyne/motion_predictor.h"
+
+// weight of the newest error in the averaged covariance
+static const double ERROR_SMOOTHING = 0.1;
+
+bool MotionPredictor::parseModel(const std::string &name, Model &model)
+{
+    if (name == "constant_velocity")
+        model = Model::ConstantVelocity;
+    else if (name == "constant_acceleration")
+        model = Model::ConstantAcceleration;
+    else
+        return false;
+    return true;
+}
+
+MotionPredictor::MotionPredictor(Model model)
+    : model(model), started(false), lastTime(0), numMotions(0), dt(0), lastDt(0)
+{
+    twist.setZero();
+    lastTwist.setZero();
+    // before the first errors, 0.1 rad and 0.1 m per sweep
+    errorCovariance = 0.01 * Matrix6d::Identity();
+}
+
+void MotionPredictor::reset(double time)
+{
+    started = true;
+    lastTime = time;
+    numMotions = 0;
+}
+
+// twist expected for the motion over the next dt seconds
+MotionPredictor::Vector6d MotionPredictor::predictTwist(double dtNext) const
+{
+    if (model == Model::ConstantAcceleration && numMotions >= 2)
+    {
+        // the twists hold at the middle of their time spans, move on from
+        // the middle of the last span to the middle of the next one
+        Vector6d acceleration = (twist - lastTwist) / (0.5 * (dt + lastDt));
+        return twist + acceleration * (0.5 * (dt + dtNext));
+    }
+    return twist;
+}
+
+static Eigen::Quaterniond rotationFromVector(const Eigen::Vector3d &theta)
+{
+    double angle = theta.norm();
+    if (angle < 1e-12)
+        return Eigen::Quaterniond::Identity();
+    return Eigen::Quaterniond(Eigen::AngleAxisd(angle, theta / angle));
+}
+
+// the angle of Eigen::AngleAxisd from a quaternion is in [0, pi]
+static Eigen::Vector3d vectorFromRotation(const Eigen::Quaterniond &q)
+{
+    Eigen::AngleAxisd angleAxis(q.normalized());
+    return angleAxis.angle() * angleAxis.axis();
+}
+
+bool MotionPredictor::predict(double time, Eigen::Quaterniond &q, Eigen::Vector3d &t, Matrix6d &covariance) const
+{
+    double dtNext = time - lastTime;
+    if (!started || numMotions == 0 || dtNext <= 0)
+        return false;
+
+    Vector6d motion = predictTwist(dtNext) * dtNext;
+    q = rotationFromVector(motion.head<3>());
+    t = motion.tail<3>();
+    covariance = errorCovariance;
+    return true;
+}
+
+void MotionPredictor::update(double time, const Eigen::Quaterniond &q, const Eigen::Vector3d &t)
+{
+    double dtNext = time - lastTime;
+    if (!started || dtNext <= 0)
+    {
+        reset(time);
+        return;
+    }
+
+    Vector6d motion;
+    motion << vectorFromRotation(q), t;
+
+    if (numMotions > 0)
+    {
+        Vector6d error = motion - predictTwist(dtNext) * dtNext;
+        errorCovariance = (1 - ERROR_SMOOTHING) * errorCovariance + ERROR_SMOOTHING * error * error.transpose();
+    }
+
+    lastTwist = twist;
+    lastDt = dt;
+    twist = motion / dtNext;
+    dt = dtNext;
+    numMotions = std::min(numMotions + 1, 2);
+    lastTime = time;
+}
@@ -0,0 +1,69 @@
+// The three stages as nodelets. Loaded into one manager, the clouds between
+// the stages are handed over as shared pointers instead of being serialized.
+// The drone name is the private parameter drone_name, or DRONE_NAME from the
+// environment like for the nodes.
+
+#include <memory>
+#include <string>
+#include <stdlib.h>     /* getenv */
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "aloam_velodyne/laser_mapping.h"
+#include "aloam_velodyne/laser_odometry.h"
+#include "aloam_velodyne/scan_registration.h"
+
+namespace aloam_velodyne
+{
+
+static std::string droneNameParam(ros::NodeHandle &privateNh)
+{
+    std::string droneName;
+    if (!privateNh.getParam("drone_name", droneName))
+    {
+        const char *env = getenv("DRONE_NAME");
+        droneName = env ? env : "";
+    }
+    return droneName;
+}
+
+class ScanRegistrationNodelet : public nodelet::Nodelet
+{
+  private:
+    void onInit() override
+    {
+        scanRegistration.reset(new ScanRegistration(getNodeHandle(), droneNameParam(getPrivateNodeHandle())));
+        if (!scanRegistration->ok())
+            NODELET_ERROR("scan registration parameters are not supported, nodelet does nothing");
+    }
+
+    std::unique_ptr<ScanRegistration> scanRegistration;
+};
+
+class LaserOdometryNodelet : public nodelet::Nodelet
+{
+  private:
+    void onInit() override
+    {
+        laserOdometry.reset(new LaserOdometry(getNodeHandle(), droneNameParam(getPrivateNodeHandle())));
+    }
+
+    std::unique_ptr<LaserOdometry> laserOdometry;
+};
+
+class LaserMappingNodelet : public nodelet::Nodelet
+{
+  private:
+    void onInit() override
+    {
+        laserMapping.reset(new LaserMapping(getNodeHandle(), droneNameParam(getPrivateNodeHandle())));
+    }
+
+    std::unique_ptr<LaserMapping> laserMapping;
+};
+
+} // namespace aloam_velodyne
+
+PLUGINLIB_EXPORT_CLASS(aloam_velodyne::ScanRegistrationNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(aloam_velodyne::LaserOdometryNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(aloam_velodyne::LaserMappingNodelet, nodelet::Nodelet)
@@ -0,0 +1,38 @@
+#include <algorithm>
+#include "aloam_velodyne/path_publisher.h"
+
+void PathPublisher::advertise(ros::NodeHandle &nh, const std::string &pathTopic, const std::string &poseTopic,
+                              int maxLength_, int decimation_)
+{
+    pubPath = nh.advertise<nav_msgs::Path>(pathTopic, 100);
+    pubPose = nh.advertise<geometry_msgs::PoseStamped>(poseTopic, 100);
+
+    maxLength = std::max(maxLength_, 1);
+    decimation = std::max(decimation_, 1);
+    ring.reserve(maxLength);
+    path.poses.reserve(maxLength);
+}
+
+void PathPublisher::publish(const geometry_msgs::PoseStamped &pose)
+{
+    pubPose.publish(pose);
+
+    if (poseCount++ % decimation != 0)
+        return;
+
+    if (ring.size() < maxLength)
+    {
+        ring.push_back(pose);
+    }
+    else
+    {
+        ring[ringStart] = pose;
+        ringStart = (ringStart + 1) % maxLength;
+    }
+
+    // oldest first
+    path.header = pose.header;
+    path.poses.assign(ring.begin() + ringStart, ring.end());
+    path.poses.insert(path.poses.end(), ring.begin(), ring.begin() + ringStart);
+    pubPath.publish(path);
+}
@@ -0,0 +1,87 @@
+#include <cmath>
+#include <algorithm>
+#include "aloam_velodyne/projective_index.h"
+
+ProjectiveIndex::ProjectiveIndex()
+    : azimuthBins(360), searchBins(2), nScans(0)
+{
+}
+
+void ProjectiveIndex::setResolution(int azimuthBins_, int searchBins_)
+{
+    azimuthBins = std::max(azimuthBins_, 1);
+    searchBins = std::min(std::max(searchBins_, 0), (azimuthBins - 1) / 2);
+}
+
+int ProjectiveIndex::azimuthBin(const PointType &point) const
+{
+    int bin = int((std::atan2(point.y, point.x) + M_PI) * (azimuthBins / (2 * M_PI)));
+    return std::min(std::max(bin, 0), azimuthBins - 1);
+}
+
+void ProjectiveIndex::setInputCloud(const pcl::PointCloud<PointType>::ConstPtr &cloud_)
+{
+    cloud = cloud_;
+    const int cloudSize = cloud->points.size();
+
+    nScans = 0;
+    for (int i = 0; i < cloudSize; i++)
+        nScans = std::max(nScans, int(cloud->points[i].intensity) + 1);
+
+    // count the points of every cell, then sort them in
+    cellStart.assign(nScans * azimuthBins + 1, 0);
+    pointCell.resize(cloudSize);
+    for (int i = 0; i < cloudSize; i++)
+    {
+        const PointType &point = cloud->points[i];
+        pointCell[i] = int(point.intensity) * azimuthBins + azimuthBin(point);
+        cellStart[pointCell[i] + 1]++;
+    }
+    for (size_t cell = 1; cell < cellStart.size(); cell++)
+        cellStart[cell] += cellStart[cell - 1];
+
+    // the points of a cell keep their cloud order
+    cellFill.assign(cellStart.begin(), cellStart.end() - 1);
+    cellPoints.resize(cloudSize);
+    for (int i = 0; i < cloudSize; i++)
+        cellPoints[cellFill[pointCell[i]]++] = i;
+}
+
+int ProjectiveIndex::nearest(const PointType &point, int firstScan, int lastScan, int skipScan, int skipIndex,
+                             double maxSqDis) const
+{
+    firstScan = std::max(firstScan, 0);
+    lastScan = std::min(lastScan, nScans - 1);
+
+    const int center = azimuthBin(point);
+    int nearestInd = -1;
+    double nearestSqDis = maxSqDis;
+    for (int scan = firstScan; scan <= lastScan; scan++)
+    {
+        if (scan == skipScan)
+            continue;
+
+        for (int offset = -searchBins; offset <= searchBins; offset++)
+        {
+            int bin = (center + offset + azimuthBins) % azimuthBins;
+            int cell = scan * azimuthBins + bin;
+            for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+            {
+                int j = cellPoints[k];
+                if (j == skipIndex)
+                    continue;
+
+                const PointType &candidate = cloud->points[j];
+                double pointSqDis = (candidate.x - point.x) * (candidate.x - point.x) +
+                                    (candidate.y - point.y) * (candidate.y - point.y) +
+                                    (candidate.z - point.z) * (candidate.z - point.z);
+                if (pointSqDis < nearestSqDis)
+                {
+                    nearestSqDis = pointSqDis;
+                    nearestInd = j;
+                }
+            }
+        }
+    }
+    return nearestInd;
+}
@@ -0,0 +1,105 @@
+#include <cmath>
+#include <algorithm>
+#include "aloam_velodyne/scan_line_downsampler.h"
+
+ScanLineDownsampler::ScanLineDownsampler()
+    : inverseLeafSize(1.0f), stamp(1), lastVoxel(-1)
+{
+    rehash(1024);
+}
+
+void ScanLineDownsampler::setLeafSize(float leafSize)
+{
+    inverseLeafSize = 1.0f / leafSize;
+}
+
+void ScanLineDownsampler::begin()
+{
+    voxels.clear();
+    lastVoxel = -1;
+    stamp++;
+    if (stamp == 0)
+    {
+        std::fill(tableStamp.begin(), tableStamp.end(), 0);
+        stamp = 1;
+    }
+}
+
+// same voxel coordinates as pcl::VoxelGrid, packed with 21 bits per axis
+std::uint64_t ScanLineDownsampler::voxelKey(const PointType &point) const
+{
+    const std::uint64_t mask = (1ull << 21) - 1;
+    std::int64_t i = static_cast<std::int64_t>(std::floor(point.x * inverseLeafSize));
+    std::int64_t j = static_cast<std::int64_t>(std::floor(point.y * inverseLeafSize));
+    std::int64_t k = static_cast<std::int64_t>(std::floor(point.z * inverseLeafSize));
+    return ((std::uint64_t(i) & mask) << 42) | ((std::uint64_t(j) & mask) << 21) | (std::uint64_t(k) & mask);
+}
+
+void ScanLineDownsampler::rehash(size_t capacity)
+{
+    table.assign(capacity, -1);
+    tableStamp.assign(capacity, 0);
+    const size_t slotMask = capacity - 1;
+    for (size_t v = 0; v < voxels.size(); v++)
+    {
+        size_t slot = (voxels[v].key * 0x9E3779B97F4A7C15ull >> 20) & slotMask;
+        while (tableStamp[slot] == stamp)
+            slot = (slot + 1) & slotMask;
+        table[slot] = v;
+        tableStamp[slot] = stamp;
+    }
+}
+
+int ScanLineDownsampler::findOrInsert(std::uint64_t key)
+{
+    // keep the table at most half full
+    if ((voxels.size() + 1) * 2 > table.size())
+        rehash(table.size() * 2);
+
+    const size_t slotMask = table.size() - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ull >> 20) & slotMask;
+    while (tableStamp[slot] == stamp)
+    {
+        if (voxels[table[slot]].key == key)
+            return table[slot];
+        slot = (slot + 1) & slotMask;
+    }
+
+    Voxel voxel;
+    voxel.key = key;
+    voxel.sumX = voxel.sumY = voxel.sumZ = voxel.sumIntensity = 0;
+    voxel.count = 0;
+    voxels.push_back(voxel);
+    table[slot] = voxels.size() - 1;
+    tableStamp[slot] = stamp;
+    return table[slot];
+}
+
+void ScanLineDownsampler::add(const PointType &point)
+{
+    std::uint64_t key = voxelKey(point);
+    if (lastVoxel < 0 || voxels[lastVoxel].key != key)
+        lastVoxel = findOrInsert(key);
+
+    Voxel &voxel = voxels[lastVoxel];
+    voxel.sumX += point.x;
+    voxel.sumY += point.y;
+    voxel.sumZ += point.z;
+    voxel.sumIntensity += point.intensity;
+    voxel.count++;
+}
+
+void ScanLineDownsampler::end(pcl::PointCloud<PointType> &out)
+{
+    out.reserve(out.size() + voxels.size());
+    PointType point;
+    for (size_t v = 0; v < voxels.size(); v++)
+    {
+        const Voxel &voxel = voxels[v];
+        point.x = voxel.sumX / voxel.count;
+        point.y = voxel.sumY / voxel.count;
+        point.z = voxel.sumZ / voxel.count;
+        point.intensity = voxel.sumIntensity / voxel.count;
+        out.push_back(point);
+    }
+}
@@ -35,11 +35,22 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
+#include "aloam_velodyne/cloud_fields.h"
+#include "aloam_velodyne/cloud_msg.h"
 #include "aloam_velodyne/common.h"
+#include "aloam_velodyne/feature_bundle.h"
+#include "aloam_velodyne/feature_extractor.h"
+#include "aloam_velodyne/imu_integrator.h"
+#include "aloam_velodyne/scan_registration.h"
 #include "aloam_velodyne/tic_toc.h"
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <geometry_msgs/QuaternionStamped.h>
 #include <nav_msgs/Odometry.h>
 #include <opencv/cv.h>
 #include <pcl_conversions/pcl_conversions.h>
@@ -52,7 +63,6 @@
 #include <sensor_msgs/PointCloud2.h>
 #include <tf/transform_datatypes.h>
 #include <tf/transform_broadcaster.h>
-#include <stdlib.h>     /* getenv */
 
 using std::atan2;
 using std::cos;
@@ -61,444 +71,485 @@ using std::sin;
 const double scanPeriod = 0.1;
 
 const int systemDelay = 0; 
-int systemInitCount = 0;
-bool systemInited = false;
-int N_SCANS = 0;
-float cloudCurvature[400000];
-int cloudSortInd[400000];
-int cloudNeighborPicked[400000];
-int cloudLabel[400000];
-
-bool comp (int i,int j) { return (cloudCurvature[i]<cloudCurvature[j]); }
-
-ros::Publisher pubLaserCloud;
-ros::Publisher pubCornerPointsSharp;
-ros::Publisher pubCornerPointsLessSharp;
-ros::Publisher pubSurfPointsFlat;
-ros::Publisher pubSurfPointsLessFlat;
-ros::Publisher pubRemovePoints;
-std::vector<ros::Publisher> pubEachScan;
-
-bool PUB_EACH_LINE = false;
-
-double MINIMUM_RANGE = 0.1; 
-
-template <typename PointT>
-void removeClosedPointCloud(const pcl::PointCloud<PointT> &cloud_in,
-                              pcl::PointCloud<PointT> &cloud_out, float thres)
+
+// imu rotations over a sweep for the deskew, points in between are interpolated
+const int deskewSegments = 32;
+
+// sweeps between two diagnostics of the feature budget
+const int budgetDiagnosticsPeriod = 10;
+
+// with the feature bundle the single clouds are only for visualisation,
+// they are not serialized unless somebody listens
+void ScanRegistration::publishCloud(const ros::Publisher &pub, const pcl::PointCloud<PointType> &cloud, const ros::Time &stamp)
 {
-    if (&cloud_in != &cloud_out)
-    {
-        cloud_out.header = cloud_in.header;
-        cloud_out.points.resize(cloud_in.points.size());
-    }
+    if (PUBLISH_FEATURE_BUNDLE && pub.getNumSubscribers() == 0)
+        return;
+
+    // laserFeatures is reused for the next sweep, subscribers get a copy
+    pub.publish(makeCloudMsg(cloud, stamp, droneName + "/camera_init"));
+}
 
-    size_t j = 0;
+void ScanRegistration::imuHandler(const sensor_msgs::ImuConstPtr &imuMsg)
+{
+    imuIntegrator->addSample(imuMsg->header.stamp.toSec(),
+                             Eigen::Vector3d(imuMsg->angular_velocity.x,
+                                             imuMsg->angular_velocity.y,
+                                             imuMsg->angular_velocity.z));
+}
 
-    for (size_t i = 0; i < cloud_in.points.size(); ++i)
+// The features are deskewed after the extraction, neighbouring points of a
+// scan line are captured so shortly after each other that the rotation
+// hardly changes their curvature. stamp is the time of relTime 0.
+void ScanRegistration::applyImu(const ros::Time &stamp)
+{
+    TicToc t_deskew;
+    double sweepTime = stamp.toSec();
+    if (imuIntegrator->rotations(sweepTime, scanPeriod / deskewSegments, deskewSegments + 1, deskewKnots))
     {
-        if (cloud_in.points[i].x * cloud_in.points[i].x + cloud_in.points[i].y * cloud_in.points[i].y + cloud_in.points[i].z * cloud_in.points[i].z < thres * thres)
-            continue;
-        cloud_out.points[j] = cloud_in.points[i];
-        j++;
+        deskewCloud(laserFeatures.laserCloud, deskewKnots, scanPeriod);
+        deskewCloud(laserFeatures.cornerPointsSharp, deskewKnots, scanPeriod);
+        deskewCloud(laserFeatures.cornerPointsLessSharp, deskewKnots, scanPeriod);
+        deskewCloud(laserFeatures.surfPointsFlat, deskewKnots, scanPeriod);
+        deskewCloud(laserFeatures.surfPointsLessFlat, deskewKnots, scanPeriod);
     }
-    if (j != cloud_in.points.size())
+    else
+        ROS_WARN("no imu data at the start of the sweep, features are not deskewed");
+
+    Eigen::Quaterniond q_last_curr;
+    if (hasLastSweep && imuIntegrator->rotation(lastSweepTime, sweepTime, q_last_curr))
     {
-        cloud_out.points.resize(j);
+        geometry_msgs::QuaternionStampedPtr imuRotationMsg(new geometry_msgs::QuaternionStamped());
+        imuRotationMsg->header.stamp = stamp;
+        imuRotationMsg->header.frame_id = droneName + "/camera_init";
+        imuRotationMsg->quaternion.x = q_last_curr.x();
+        imuRotationMsg->quaternion.y = q_last_curr.y();
+        imuRotationMsg->quaternion.z = q_last_curr.z();
+        imuRotationMsg->quaternion.w = q_last_curr.w();
+        pubImuRotation.publish(imuRotationMsg);
     }
-
-    cloud_out.height = 1;
-    cloud_out.width = static_cast<uint32_t>(j);
-    cloud_out.is_dense = true;
+    hasLastSweep = true;
+    lastSweepTime = sweepTime;
+    printf("imu deskew time %f \n", t_deskew.toc());
 }
 
-void laserCloudHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg)
+// the odometry of a sweep ends the latency of the sweep
+void ScanRegistration::laserOdometryHandler(const nav_msgs::Odometry::ConstPtr &laserOdometry)
 {
-    if (!systemInited)
-    { 
-        systemInitCount++;
-        if (systemInitCount >= systemDelay)
-        {
-            systemInited = true;
-        }
-        else
-            return;
-    }
+    double time = laserOdometry->header.stamp.toSec();
+    std::lock_guard<std::mutex> lock(mBudget);
+    while (!sweepArrivals.empty() && sweepArrivals.front().first < time - 1e-3)
+        sweepArrivals.pop_front();
+    if (sweepArrivals.empty() || sweepArrivals.front().first > time + 1e-3)
+        return;
+
+    std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - sweepArrivals.front().second;
+    sweepArrivals.pop_front();
+    budgetController->addLatency(latency.count());
+
+    budgetSweepCount++;
+    if (budgetSweepCount % budgetDiagnosticsPeriod == 0)
+        publishDiagnostics();
+}
 
-    TicToc t_whole;
-    TicToc t_prepare;
-    std::vector<int> scanStartInd(N_SCANS, 0);
-    std::vector<int> scanEndInd(N_SCANS, 0);
+// the odometry callback may run on another thread than the cloud callbacks
+void ScanRegistration::applyBudget()
+{
+    std::lock_guard<std::mutex> lock(mBudget);
+    featureExtractor->options.budget = budgetController->budget();
+}
 
-    pcl::PointCloud<pcl::PointXYZ> laserCloudIn;
-    pcl::fromROSMsg(*laserCloudMsg, laserCloudIn);
-    std::vector<int> indices;
+void ScanRegistration::publishDiagnostics()
+{
+    const FeatureExtractor::Budget &budget = budgetController->budget();
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = droneName + " scanRegistration feature budget";
+    status.hardware_id = droneName;
+    if (budgetController->saturated())
+    {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = "latency over target at the minimum budget";
+    }
+    else
+    {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "ok";
+    }
 
-    pcl::removeNaNFromPointCloud(laserCloudIn, laserCloudIn, indices);
-    removeClosedPointCloud(laserCloudIn, laserCloudIn, MINIMUM_RANGE);
+    const std::pair<std::string, std::string> values[] = {
+        {"latency ms", std::to_string(budgetController->smoothedLatency())},
+        {"target latency ms", std::to_string(budgetController->options.targetLatency)},
+        {"level", std::to_string(budgetController->level())},
+        {"sharp per sextant", std::to_string(budget.sharp)},
+        {"less sharp per sextant", std::to_string(budget.lessSharp)},
+        {"flat per sextant", std::to_string(budget.flat)},
+        {"curvature threshold", std::to_string(budget.curvatureThreshold)}};
+    for (const std::pair<std::string, std::string> &value : values)
+    {
+        diagnostic_msgs::KeyValue keyValue;
+        keyValue.key = value.first;
+        keyValue.value = value.second;
+        status.values.push_back(keyValue);
+    }
 
+    diagnostic_msgs::DiagnosticArrayPtr diagnosticsMsg(new diagnostic_msgs::DiagnosticArray());
+    diagnosticsMsg->header.stamp = ros::Time::now();
+    diagnosticsMsg->status.push_back(status);
+    pubDiagnostics.publish(diagnosticsMsg);
+}
 
-    int cloudSize = laserCloudIn.points.size();
-    float startOri = -atan2(laserCloudIn.points[0].y, laserCloudIn.points[0].x);
-    float endOri = -atan2(laserCloudIn.points[cloudSize - 1].y,
-                          laserCloudIn.points[cloudSize - 1].x) +
-                   2 * M_PI;
+void ScanRegistration::publishFeatures(const ros::Time &stamp)
+{
+    if (USE_IMU)
+        applyImu(stamp);
 
-    if (endOri - startOri > 3 * M_PI)
-    {
-        endOri -= 2 * M_PI;
-    }
-    else if (endOri - startOri < M_PI)
+    if (budgetController)
     {
-        endOri += 2 * M_PI;
+        std::lock_guard<std::mutex> lock(mBudget);
+        sweepArrivals.push_back(std::make_pair(stamp.toSec(), sweepArrival));
+        // odometry is not running or drops sweeps, forget the old ones
+        if (sweepArrivals.size() > 50)
+            sweepArrivals.pop_front();
     }
-    //printf("end Ori %f\n", endOri);
 
-    bool halfPassed = false;
-    int count = cloudSize;
-    PointType point;
-    std::vector<pcl::PointCloud<PointType>> laserCloudScans(N_SCANS);
-    for (int i = 0; i < cloudSize; i++)
+    const pcl::PointCloud<PointType> &laserCloud = laserFeatures.laserCloud;
+
+    if (PUBLISH_FEATURE_BUNDLE)
     {
-        point.x = laserCloudIn.points[i].x;
-        point.y = laserCloudIn.points[i].y;
-        point.z = laserCloudIn.points[i].z;
+        const pcl::PointCloud<PointType> *sets[aloam_velodyne::FeatureBundle::NUM_SETS];
+        sets[aloam_velodyne::FeatureBundle::FULL_CLOUD] = &laserCloud;
+        sets[aloam_velodyne::FeatureBundle::CORNER_SHARP] = &laserFeatures.cornerPointsSharp;
+        sets[aloam_velodyne::FeatureBundle::CORNER_LESS_SHARP] = &laserFeatures.cornerPointsLessSharp;
+        sets[aloam_velodyne::FeatureBundle::SURF_FLAT] = &laserFeatures.surfPointsFlat;
+        sets[aloam_velodyne::FeatureBundle::SURF_LESS_FLAT] = &laserFeatures.surfPointsLessFlat;
+
+        aloam_velodyne::FeatureBundlePtr featureBundleMsg(new aloam_velodyne::FeatureBundle());
+        packFeatureBundle(sets, laserCloudBundle, *featureBundleMsg);
+        featureBundleMsg->header.stamp = stamp;
+        featureBundleMsg->header.frame_id = droneName + "/camera_init";
+        featureBundleMsg->cloud.header = featureBundleMsg->header;
+        pubFeatureBundle.publish(featureBundleMsg);
+    }
 
-        float angle = atan(point.z / sqrt(point.x * point.x + point.y * point.y)) * 180 / M_PI;
-        int scanID = 0;
+    publishCloud(pubLaserCloud, laserCloud, stamp);
+    publishCloud(pubCornerPointsSharp, laserFeatures.cornerPointsSharp, stamp);
+    publishCloud(pubCornerPointsLessSharp, laserFeatures.cornerPointsLessSharp, stamp);
+    publishCloud(pubSurfPointsFlat, laserFeatures.surfPointsFlat, stamp);
+    publishCloud(pubSurfPointsLessFlat, laserFeatures.surfPointsLessFlat, stamp);
 
-        if (N_SCANS == 16)
-        {
-            scanID = int((angle + 15) / 2 + 0.5);
-            if (scanID > (N_SCANS - 1) || scanID < 0)
-            {
-                count--;
-                continue;
-            }
-        }
-        else if (N_SCANS == 32)
+    // pub each scam
+    if(PUB_EACH_LINE)
+    {
+        const RangeImage &rangeImage = laserFeatures.rangeImage;
+        for(int i = 0; i< N_SCANS; i++)
         {
-            scanID = int((angle + 92.0/3.0) * 3.0 / 4.0);
-            if (scanID > (N_SCANS - 1) || scanID < 0)
-            {
-                count--;
-                continue;
-            }
-        }
-        else if (N_SCANS == 64)
-        {   
-            if (angle >= -8.83)
-                scanID = int((2 - angle) * 3.0 + 0.5);
-            else
-                scanID = N_SCANS / 2 + int((-8.83 - angle) * 2.0 + 0.5);
-
-            // use [0 50]  > 50 remove outlies 
-            if (angle > 2 || angle < -24.33 || scanID > 50 || scanID < 0)
-            {
-                count--;
-                continue;
-            }
+            pcl::PointCloud<PointType>::Ptr laserCloudScan(new pcl::PointCloud<PointType>());
+            laserCloudScan->points.assign(laserCloud.points.begin() + rangeImage.rowBegin(i),
+                                          laserCloud.points.begin() + rangeImage.rowEnd(i));
+            laserCloudScan->width = laserCloudScan->points.size();
+            laserCloudScan->height = 1;
+            setCloudHeader(*laserCloudScan, stamp, droneName + "/camera_init");
+            pubEachScan[i].publish(laserCloudScan);
         }
-        else
+    }
+}
+
+// skips the first systemDelay sweeps, counted in messages of either handler
+bool ScanRegistration::systemReady()
+{
+    if (!systemInited)
+    { 
+        systemInitCount++;
+        if (systemInitCount >= systemDelay * SWEEP_SEGMENTS)
         {
-            printf("wrong scan number\n");
-            ROS_BREAK();
-        }
-        //printf("angle %f scanID %d \n", angle, scanID);
-
-        float ori = -atan2(point.y, point.x);
-        if (!halfPassed)
-        { 
-            if (ori < startOri - M_PI / 2)
-            {
-                ori += 2 * M_PI;
-            }
-            else if (ori > startOri + M_PI * 3 / 2)
-            {
-                ori -= 2 * M_PI;
-            }
-
-            if (ori - startOri > M_PI)
-            {
-                halfPassed = true;
-            }
+            systemInited = true;
         }
         else
-        {
-            ori += 2 * M_PI;
-            if (ori < endOri - M_PI * 3 / 2)
-            {
-                ori += 2 * M_PI;
-            }
-            else if (ori > endOri + M_PI / 2)
-            {
-                ori -= 2 * M_PI;
-            }
-        }
-
-        float relTime = (ori - startOri) / (endOri - startOri);
-        point.intensity = scanID + scanPeriod * relTime;
-        laserCloudScans[scanID].push_back(point); 
+            return false;
     }
-    
-    cloudSize = count;
-    printf("points size %d \n", cloudSize);
+    return true;
+}
 
-    pcl::PointCloud<PointType>::Ptr laserCloud(new pcl::PointCloud<PointType>());
-    for (int i = 0; i < N_SCANS; i++)
-    { 
-        scanStartInd[i] = laserCloud->size() + 5;
-        *laserCloud += laserCloudScans[i];
-        scanEndInd[i] = laserCloud->size() - 6;
+void ScanRegistration::laserCloudHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg)
+{
+    if (!systemReady())
+        return;
+
+    TicToc t_whole;
+    sweepArrival = std::chrono::steady_clock::now();
+    if (budgetController)
+        applyBudget();
+
+    // the clouds are decoded and filtered in one pass into reused buffers,
+    // which counts as preparing the sweep
+    TicToc t_decode;
+    double timeDecode = 0;
+    if (USE_RING_TIME_FIELDS &&
+        decodeRingTimeCloud(*laserCloudMsg, RING_FIELD, TIME_FIELD, N_SCANS, scanPeriod, MINIMUM_RANGE, laserCloudTagged))
+    {
+        timeDecode = t_decode.toc();
+        featureExtractor->extractTagged(laserCloudTagged, laserFeatures);
+    }
+    else if (decodeXYZCloud(*laserCloudMsg, MINIMUM_RANGE, laserCloudIn))
+    {
+        timeDecode = t_decode.toc();
+        if (USE_RING_TIME_FIELDS)
+            ROS_WARN_ONCE("point cloud has no %s or %s field, compute scan lines from the angles",
+                          RING_FIELD.c_str(), TIME_FIELD.c_str());
+        featureExtractor->extractFiltered(laserCloudIn, laserFeatures);
+    }
+    else
+    {
+        ROS_WARN("point cloud has no x, y or z field or is truncated, skip it");
+        return;
     }
 
-    printf("prepare time %f \n", t_prepare.toc());
+    printf("points size %d \n", (int)laserFeatures.laserCloud.size());
+    printf("prepare time %f \n", timeDecode + laserFeatures.timePrepare);
+    printf("select q time %f \n", laserFeatures.timeSelectQ);
+    printf("seperate points time %f \n", laserFeatures.timeSeparate);
 
-    for (int i = 5; i < cloudSize - 5; i++)
-    { 
-        float diffX = laserCloud->points[i - 5].x + laserCloud->points[i - 4].x + laserCloud->points[i - 3].x + laserCloud->points[i - 2].x + laserCloud->points[i - 1].x - 10 * laserCloud->points[i].x + laserCloud->points[i + 1].x + laserCloud->points[i + 2].x + laserCloud->points[i + 3].x + laserCloud->points[i + 4].x + laserCloud->points[i + 5].x;
-        float diffY = laserCloud->points[i - 5].y + laserCloud->points[i - 4].y + laserCloud->points[i - 3].y + laserCloud->points[i - 2].y + laserCloud->points[i - 1].y - 10 * laserCloud->points[i].y + laserCloud->points[i + 1].y + laserCloud->points[i + 2].y + laserCloud->points[i + 3].y + laserCloud->points[i + 4].y + laserCloud->points[i + 5].y;
-        float diffZ = laserCloud->points[i - 5].z + laserCloud->points[i - 4].z + laserCloud->points[i - 3].z + laserCloud->points[i - 2].z + laserCloud->points[i - 1].z - 10 * laserCloud->points[i].z + laserCloud->points[i + 1].z + laserCloud->points[i + 2].z + laserCloud->points[i + 3].z + laserCloud->points[i + 4].z + laserCloud->points[i + 5].z;
-
-        cloudCurvature[i] = diffX * diffX + diffY * diffY + diffZ * diffZ;
-        cloudSortInd[i] = i;
-        cloudNeighborPicked[i] = 0;
-        cloudLabel[i] = 0;
-    }
+    publishFeatures(laserCloudMsg->header.stamp);
 
+    printf("scan registration time %f ms *************\n", t_whole.toc());
+    if(t_whole.toc() > 100)
+        ROS_WARN("scan registration process over 100ms");
+}
 
-    TicToc t_pts;
+void ScanRegistration::finishSweep()
+{
+    TicToc t_end;
+    sweepArrival = std::chrono::steady_clock::now();
+    featureExtractor->endSweep(laserFeatures);
 
-    pcl::PointCloud<PointType> cornerPointsSharp;
-    pcl::PointCloud<PointType> cornerPointsLessSharp;
-    pcl::PointCloud<PointType> surfPointsFlat;
-    pcl::PointCloud<PointType> surfPointsLessFlat;
+    printf("points size %d \n", (int)laserFeatures.laserCloud.size());
+    printf("select q time %f \n", laserFeatures.timeSelectQ);
+    printf("end of sweep time %f \n", laserFeatures.timeSeparate);
 
-    float t_q_sort = 0;
-    for (int i = 0; i < N_SCANS; i++)
-    {
-        if( scanEndInd[i] - scanStartInd[i] < 6)
-            continue;
-        pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScan(new pcl::PointCloud<PointType>);
-        for (int j = 0; j < 6; j++)
-        {
-            int sp = scanStartInd[i] + (scanEndInd[i] - scanStartInd[i]) * j / 6; 
-            int ep = scanStartInd[i] + (scanEndInd[i] - scanStartInd[i]) * (j + 1) / 6 - 1;
-
-            TicToc t_tmp;
-            std::sort (cloudSortInd + sp, cloudSortInd + ep + 1, comp);
-            t_q_sort += t_tmp.toc();
-
-            int largestPickedNum = 0;
-            for (int k = ep; k >= sp; k--)
-            {
-                int ind = cloudSortInd[k]; 
-
-                if (cloudNeighborPicked[ind] == 0 &&
-                    cloudCurvature[ind] > 0.1)
-                {
-
-                    largestPickedNum++;
-                    if (largestPickedNum <= 2)
-                    {                        
-                        cloudLabel[ind] = 2;
-                        cornerPointsSharp.push_back(laserCloud->points[ind]);
-                        cornerPointsLessSharp.push_back(laserCloud->points[ind]);
-                    }
-                    else if (largestPickedNum <= 20)
-                    {                        
-                        cloudLabel[ind] = 1; 
-                        cornerPointsLessSharp.push_back(laserCloud->points[ind]);
-                    }
-                    else
-                    {
-                        break;
-                    }
-
-                    cloudNeighborPicked[ind] = 1; 
-
-                    for (int l = 1; l <= 5; l++)
-                    {
-                        float diffX = laserCloud->points[ind + l].x - laserCloud->points[ind + l - 1].x;
-                        float diffY = laserCloud->points[ind + l].y - laserCloud->points[ind + l - 1].y;
-                        float diffZ = laserCloud->points[ind + l].z - laserCloud->points[ind + l - 1].z;
-                        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
-                        {
-                            break;
-                        }
-
-                        cloudNeighborPicked[ind + l] = 1;
-                    }
-                    for (int l = -1; l >= -5; l--)
-                    {
-                        float diffX = laserCloud->points[ind + l].x - laserCloud->points[ind + l + 1].x;
-                        float diffY = laserCloud->points[ind + l].y - laserCloud->points[ind + l + 1].y;
-                        float diffZ = laserCloud->points[ind + l].z - laserCloud->points[ind + l + 1].z;
-                        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
-                        {
-                            break;
-                        }
-
-                        cloudNeighborPicked[ind + l] = 1;
-                    }
-                }
-            }
-
-            int smallestPickedNum = 0;
-            for (int k = sp; k <= ep; k++)
-            {
-                int ind = cloudSortInd[k];
-
-                if (cloudNeighborPicked[ind] == 0 &&
-                    cloudCurvature[ind] < 0.1)
-                {
-
-                    cloudLabel[ind] = -1; 
-                    surfPointsFlat.push_back(laserCloud->points[ind]);
-
-                    smallestPickedNum++;
-                    if (smallestPickedNum >= 4)
-                    { 
-                        break;
-                    }
-
-                    cloudNeighborPicked[ind] = 1;
-                    for (int l = 1; l <= 5; l++)
-                    { 
-                        float diffX = laserCloud->points[ind + l].x - laserCloud->points[ind + l - 1].x;
-                        float diffY = laserCloud->points[ind + l].y - laserCloud->points[ind + l - 1].y;
-                        float diffZ = laserCloud->points[ind + l].z - laserCloud->points[ind + l - 1].z;
-                        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
-                        {
-                            break;
-                        }
-
-                        cloudNeighborPicked[ind + l] = 1;
-                    }
-                    for (int l = -1; l >= -5; l--)
-                    {
-                        float diffX = laserCloud->points[ind + l].x - laserCloud->points[ind + l + 1].x;
-                        float diffY = laserCloud->points[ind + l].y - laserCloud->points[ind + l + 1].y;
-                        float diffZ = laserCloud->points[ind + l].z - laserCloud->points[ind + l + 1].z;
-                        if (diffX * diffX + diffY * diffY + diffZ * diffZ > 0.05)
-                        {
-                            break;
-                        }
-
-                        cloudNeighborPicked[ind + l] = 1;
-                    }
-                }
-            }
-
-            for (int k = sp; k <= ep; k++)
-            {
-                if (cloudLabel[k] <= 0)
-                {
-                    surfPointsLessFlatScan->push_back(laserCloud->points[k]);
-                }
-            }
-        }
+    publishFeatures(sweepStamp);
+    sweepOpen = false;
 
-        pcl::PointCloud<PointType> surfPointsLessFlatScanDS;
-        pcl::VoxelGrid<PointType> downSizeFilter;
-        downSizeFilter.setInputCloud(surfPointsLessFlatScan);
-        downSizeFilter.setLeafSize(0.2, 0.2, 0.2);
-        downSizeFilter.filter(surfPointsLessFlatScanDS);
+    printf("scan registration sweep end time %f ms *************\n", t_end.toc());
+}
+
+// Each message is one segment of a sweep. The features of a sweep are
+// published when its last segment arrives, or when a segment of the next
+// sweep shows up first.
+void ScanRegistration::laserSegmentHandler(const sensor_msgs::PointCloud2ConstPtr &laserSegmentMsg)
+{
+    if (!systemReady())
+        return;
 
-        surfPointsLessFlat += surfPointsLessFlatScanDS;
+    double segmentStart = laserSegmentMsg->header.stamp.toSec();
+    if (sweepOpen && segmentStart - sweepStart > scanPeriod * (1 - 0.5 / SWEEP_SEGMENTS))
+    {
+        ROS_WARN("sweep ended after %d of %d segments", sweepSegmentCount, SWEEP_SEGMENTS);
+        finishSweep();
+    }
+    if (!sweepOpen)
+    {
+        sweepStart = segmentStart;
+        sweepStamp = laserSegmentMsg->header.stamp;
+        sweepSegmentCount = 0;
+        sweepOpen = true;
+        if (budgetController)
+            applyBudget();
+        featureExtractor->beginSweep();
     }
-    printf("sort q time %f \n", t_q_sort);
-    printf("seperate points time %f \n", t_pts.toc());
-
-
-    sensor_msgs::PointCloud2 laserCloudOutMsg;
-    pcl::toROSMsg(*laserCloud, laserCloudOutMsg);
-    laserCloudOutMsg.header.stamp = laserCloudMsg->header.stamp;
-    laserCloudOutMsg.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-    pubLaserCloud.publish(laserCloudOutMsg);
-
-    sensor_msgs::PointCloud2 cornerPointsSharpMsg;
-    pcl::toROSMsg(cornerPointsSharp, cornerPointsSharpMsg);
-    cornerPointsSharpMsg.header.stamp = laserCloudMsg->header.stamp;
-    cornerPointsSharpMsg.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-    pubCornerPointsSharp.publish(cornerPointsSharpMsg);
-
-    sensor_msgs::PointCloud2 cornerPointsLessSharpMsg;
-    pcl::toROSMsg(cornerPointsLessSharp, cornerPointsLessSharpMsg);
-    cornerPointsLessSharpMsg.header.stamp = laserCloudMsg->header.stamp;
-    cornerPointsLessSharpMsg.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-    pubCornerPointsLessSharp.publish(cornerPointsLessSharpMsg);
-
-    sensor_msgs::PointCloud2 surfPointsFlat2;
-    pcl::toROSMsg(surfPointsFlat, surfPointsFlat2);
-    surfPointsFlat2.header.stamp = laserCloudMsg->header.stamp;
-    surfPointsFlat2.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-    pubSurfPointsFlat.publish(surfPointsFlat2);
-
-    sensor_msgs::PointCloud2 surfPointsLessFlat2;
-    pcl::toROSMsg(surfPointsLessFlat, surfPointsLessFlat2);
-    surfPointsLessFlat2.header.stamp = laserCloudMsg->header.stamp;
-    surfPointsLessFlat2.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-    pubSurfPointsLessFlat.publish(surfPointsLessFlat2);
 
-    // pub each scam
-    if(PUB_EACH_LINE)
+    TicToc t_segment;
+    double timeOrigin = TIME_FIELD_FROM_SWEEP_START ? 0.0 : segmentStart - sweepStart;
+    if (!decodeRingTimeSegment(*laserSegmentMsg, RING_FIELD, TIME_FIELD, TIME_FIELD_SCALE, timeOrigin,
+                               N_SCANS, scanPeriod, MINIMUM_RANGE, laserCloudTagged))
     {
-        for(int i = 0; i< N_SCANS; i++)
-        {
-            sensor_msgs::PointCloud2 scanMsg;
-            pcl::toROSMsg(laserCloudScans[i], scanMsg);
-            scanMsg.header.stamp = laserCloudMsg->header.stamp;
-            scanMsg.header.frame_id = std::string(getenv("DRONE_NAME")) + "/camera_init";
-            pubEachScan[i].publish(scanMsg);
-        }
+        ROS_WARN_THROTTLE(1.0, "point cloud segment has no %s or %s field or is truncated, skip it", RING_FIELD.c_str(),
+                          TIME_FIELD.c_str());
+        return;
     }
+    featureExtractor->addSegment(laserCloudTagged);
+    sweepSegmentCount++;
+    printf("segment %d time %f ms \n", sweepSegmentCount, t_segment.toc());
 
-    printf("scan registration time %f ms *************\n", t_whole.toc());
-    if(t_whole.toc() > 100)
-        ROS_WARN("scan registration process over 100ms");
+    if (sweepSegmentCount == SWEEP_SEGMENTS)
+        finishSweep();
 }
 
-int main(int argc, char **argv)
+ScanRegistration::ScanRegistration(ros::NodeHandle &nh, const std::string &droneName, ThreadPool *sharedPool)
+    : droneName(droneName)
 {
-    ros::init(argc, argv, std::string(getenv("DRONE_NAME")) + "_scanRegistration");
-    ros::NodeHandle nh;
-
     nh.param<int>("scan_line", N_SCANS, 16);
 
     nh.param<double>("minimum_range", MINIMUM_RANGE, 0.1);
 
+    int numThreads = 1;
+    nh.param<int>("scan_registration_threads", numThreads, 1);
+
+    int horizontalResolution = 1800;
+    nh.param<int>("horizontal_resolution", horizontalResolution, 1800);
+
+    std::string curvatureKernelParam;
+    nh.param<std::string>("curvature_kernel", curvatureKernelParam, "auto");
+
+    nh.param<bool>("use_ring_time_fields", USE_RING_TIME_FIELDS, false);
+    nh.param<std::string>("ring_field", RING_FIELD, "ring");
+    nh.param<std::string>("time_field", TIME_FIELD, "t");
+    nh.param<int>("sweep_segments", SWEEP_SEGMENTS, 1);
+    nh.param<bool>("feature_bundle", PUBLISH_FEATURE_BUNDLE, false);
+    nh.param<double>("time_field_scale", TIME_FIELD_SCALE, 1e-9);
+    nh.param<bool>("time_field_from_sweep_start", TIME_FIELD_FROM_SWEEP_START, true);
+
+    FeatureExtractor::Ground ground;
+    nh.param<bool>("ground_segmentation", ground.enabled, false);
+    nh.param<double>("ground_max_slope", ground.maxSlope, 10.0);
+    nh.param<int>("ground_flat_num", ground.flat, 1);
+    nh.param<double>("ground_leaf_size", ground.leafSize, 0.6);
+
+    // feature budget per sextant, the maximum one if latency_target is set
+    FeatureExtractor::Budget maxBudget, minBudget;
+    nh.param<int>("corner_sharp_num", maxBudget.sharp, 2);
+    nh.param<int>("corner_less_sharp_num", maxBudget.lessSharp, 20);
+    nh.param<int>("surf_flat_num", maxBudget.flat, 4);
+    nh.param<double>("curvature_threshold", maxBudget.curvatureThreshold, 0.1);
+    double latencyTarget = 0;
+    nh.param<double>("latency_target", latencyTarget, 0.0);
+    nh.param<int>("min_corner_sharp_num", minBudget.sharp, 1);
+    nh.param<int>("min_corner_less_sharp_num", minBudget.lessSharp, 6);
+    nh.param<int>("min_surf_flat_num", minBudget.flat, 2);
+    nh.param<double>("min_curvature_threshold", minBudget.curvatureThreshold, maxBudget.curvatureThreshold);
+
+    nh.param<bool>("use_imu", USE_IMU, false);
+    std::string imuTopic;
+    nh.param<std::string>("imu_topic", imuTopic, "_os_cloud_node/imu");
+    // roll, pitch and yaw that rotate the imu axes onto the lidar axes
+    std::vector<double> imuToLidarRPY;
+    nh.param<std::vector<double>>("imu_to_lidar_rpy", imuToLidarRPY, std::vector<double>(3, 0.0));
+
     printf("scan line number %d \n", N_SCANS);
 
-    if(N_SCANS != 16 && N_SCANS != 32 && N_SCANS != 64)
+    if(SWEEP_SEGMENTS > 1 && !USE_RING_TIME_FIELDS)
+    {
+        printf("streaming sweep segments needs the ring and time fields, use whole sweeps \n");
+        SWEEP_SEGMENTS = 1;
+    }
+
+    if(USE_RING_TIME_FIELDS)
+    {
+        printf("use %s and %s fields of the point cloud \n", RING_FIELD.c_str(), TIME_FIELD.c_str());
+        if (N_SCANS <= 0)
+        {
+            printf("scan line number must be positive!");
+            return;
+        }
+    }
+    else if(!FeatureExtractor::isSupportedScanNum(N_SCANS))
     {
         printf("only support velodyne with 16, 32 or 64 scan line!");
-        return 0;
+        return;
     }   
 
-    ros::Subscriber subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "_os_cloud_node/points", 100, laserCloudHandler);
+    FeatureExtractor::Options extractorOptions;
+    extractorOptions.nScans = N_SCANS;
+    extractorOptions.scanPeriod = scanPeriod;
+    extractorOptions.horizontalResolution = horizontalResolution;
+    if (!parseCurvatureKernel(curvatureKernelParam, extractorOptions.curvatureKernel))
+    {
+        printf("unknown curvature kernel %s, use auto \n", curvatureKernelParam.c_str());
+        extractorOptions.curvatureKernel = bestCurvatureKernel();
+    }
+    else if (!curvatureKernelSupported(extractorOptions.curvatureKernel))
+    {
+        printf("curvature kernel %s not supported by this cpu, use auto \n", curvatureKernelParam.c_str());
+        extractorOptions.curvatureKernel = bestCurvatureKernel();
+    }
+    printf("curvature kernel %s \n", curvatureKernelName(extractorOptions.curvatureKernel));
+
+    maxBudget.sharp = std::max(maxBudget.sharp, 1);
+    maxBudget.lessSharp = std::max(maxBudget.lessSharp, maxBudget.sharp);
+    maxBudget.flat = std::max(maxBudget.flat, 1);
+    extractorOptions.budget = maxBudget;
+    printf("features per sextant sharp %d less sharp %d flat %d curvature threshold %f \n",
+           maxBudget.sharp, maxBudget.lessSharp, maxBudget.flat, maxBudget.curvatureThreshold);
+    extractorOptions.ground = ground;
+    if (ground.enabled)
+        printf("ground segmentation up to %f deg, %d flat ground points per sextant, ground leaf size %f \n",
+               ground.maxSlope, ground.flat, ground.leafSize);
+    featureExtractor.reset(new FeatureExtractor(extractorOptions));
+
+    // the handler thread works too, so the pool only needs the extra threads
+    if (sharedPool)
+    {
+        printf("scan registration on a shared pool of %d threads \n", sharedPool->size());
+        featureExtractor->setThreadPool(sharedPool);
+    }
+    else if (numThreads > 1)
+    {
+        printf("scan registration threads %d \n", numThreads);
+        threadPool.reset(new ThreadPool(numThreads - 1));
+        featureExtractor->setThreadPool(threadPool.get());
+    }
+
+    if (USE_IMU)
+    {
+        if (imuToLidarRPY.size() != 3)
+        {
+            printf("imu_to_lidar_rpy needs roll, pitch and yaw, use identity \n");
+            imuToLidarRPY.assign(3, 0.0);
+        }
+        Eigen::Quaterniond q_lidar_imu = Eigen::AngleAxisd(imuToLidarRPY[2], Eigen::Vector3d::UnitZ()) *
+                                         Eigen::AngleAxisd(imuToLidarRPY[1], Eigen::Vector3d::UnitY()) *
+                                         Eigen::AngleAxisd(imuToLidarRPY[0], Eigen::Vector3d::UnitX());
+        imuIntegrator.reset(new ImuIntegrator(q_lidar_imu));
+        printf("deskew with imu %s \n", (droneName + imuTopic).c_str());
+        subImu = nh.subscribe<sensor_msgs::Imu>(droneName + imuTopic, 1000, &ScanRegistration::imuHandler, this,
+                                                ros::TransportHints().tcpNoDelay());
+        pubImuRotation = nh.advertise<geometry_msgs::QuaternionStamped>(droneName + "/laser_imu_rotation", 100);
+    }
 
-    pubLaserCloud = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/velodyne_cloud_2", 100);
+    if (latencyTarget > 0)
+    {
+        FeatureBudgetController::Options budgetOptions;
+        budgetOptions.targetLatency = latencyTarget;
+        budgetOptions.maxBudget = maxBudget;
+        minBudget.sharp = std::min(std::max(minBudget.sharp, 1), maxBudget.sharp);
+        minBudget.lessSharp = std::min(std::max(minBudget.lessSharp, minBudget.sharp), maxBudget.lessSharp);
+        minBudget.flat = std::min(std::max(minBudget.flat, 1), maxBudget.flat);
+        budgetOptions.minBudget = minBudget;
+        budgetController.reset(new FeatureBudgetController(budgetOptions));
+        printf("hold latency at %f ms with at least sharp %d less sharp %d flat %d per sextant \n",
+               latencyTarget, minBudget.sharp, minBudget.lessSharp, minBudget.flat);
+        subLaserOdometry = nh.subscribe<nav_msgs::Odometry>(droneName + "/laser_odom_to_init", 100, &ScanRegistration::laserOdometryHandler, this);
+        pubDiagnostics = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+    }
+
+    if (SWEEP_SEGMENTS > 1)
+    {
+        printf("stream %d segments per sweep \n", SWEEP_SEGMENTS);
+        subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>(droneName + "_os_cloud_node/points", 100, &ScanRegistration::laserSegmentHandler, this);
+    }
+    else
+        subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>(droneName + "_os_cloud_node/points", 100, &ScanRegistration::laserCloudHandler, this);
 
-    pubCornerPointsSharp = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_sharp", 100);
+    pubLaserCloud = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/velodyne_cloud_2", 100);
 
-    pubCornerPointsLessSharp = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_less_sharp", 100);
+    pubCornerPointsSharp = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_sharp", 100);
 
-    pubSurfPointsFlat = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_flat", 100);
+    pubCornerPointsLessSharp = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_less_sharp", 100);
 
-    pubSurfPointsLessFlat = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_cloud_less_flat", 100);
+    pubSurfPointsFlat = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_flat", 100);
 
-    pubRemovePoints = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_remove_points", 100);
+    pubSurfPointsLessFlat = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_cloud_less_flat", 100);
+
+    if (PUBLISH_FEATURE_BUNDLE)
+        pubFeatureBundle = nh.advertise<aloam_velodyne::FeatureBundle>(droneName + "/laser_feature_bundle", 100);
+
+    pubRemovePoints = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_remove_points", 100);
 
     if(PUB_EACH_LINE)
     {
         for(int i = 0; i < N_SCANS; i++)
         {
-            ros::Publisher tmp = nh.advertise<sensor_msgs::PointCloud2>(std::string(getenv("DRONE_NAME")) + "/laser_scanid_" + std::to_string(i), 100);
+            ros::Publisher tmp = nh.advertise<pcl::PointCloud<PointType>>(droneName + "/laser_scanid_" + std::to_string(i), 100);
             pubEachScan.push_back(tmp);
         }
     }
-    ros::spin();
-
-    return 0;
+    initialized = true;
 }
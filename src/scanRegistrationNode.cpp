@@ -0,0 +1,19 @@
+#include <string>
+#include <stdlib.h>     /* getenv */
+#include <ros/ros.h>
+
+#include "aloam_velodyne/scan_registration.h"
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, std::string(getenv("DRONE_NAME")) + "_scanRegistration");
+    ros::NodeHandle nh;
+
+    ScanRegistration scanRegistration(nh, std::string(getenv("DRONE_NAME")));
+    if (!scanRegistration.ok())
+        return 0;
+
+    ros::spin();
+
+    return 0;
+}
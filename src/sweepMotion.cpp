@@ -0,0 +1,88 @@
+#include <algorithm>
+#include "aloam_velodyne/sweep_motion.h"
+
+SweepMotion::SweepMotion(double scanPeriod, int numSegments)
+    : inverseScanPeriod(1.0 / scanPeriod), numSegments(std::max(numSegments, 1)), distortion(false)
+{
+    set(Eigen::Quaterniond::Identity(), Eigen::Vector3d::Zero(), false);
+}
+
+void SweepMotion::setSlopes(const Transforms &knots, Transforms &slopes)
+{
+    slopes.resize(knots.size());
+    for (size_t k = 0; k + 1 < knots.size(); k++)
+        slopes[k] = knots[k + 1] - knots[k];
+    slopes.back().setZero();
+}
+
+void SweepMotion::set(const Eigen::Quaterniond &q, const Eigen::Vector3d &t, bool distortion_)
+{
+    distortion = distortion_;
+    const int numKnots = distortion ? numSegments + 1 : 1;
+    const Eigen::Matrix3d R_end_start = q.conjugate().toRotationMatrix();
+
+    startKnots.resize(numKnots);
+    endKnots.resize(numKnots);
+    for (int k = 0; k < numKnots; k++)
+    {
+        double s = distortion ? double(k) / numSegments : 1.0;
+        Eigen::Matrix3d R_s = Eigen::Quaterniond::Identity().slerp(s, q).toRotationMatrix();
+        Eigen::Vector3d t_s = s * t;
+
+        startKnots[k].leftCols<3>() = R_s.cast<float>();
+        startKnots[k].col(3) = t_s.cast<float>();
+
+        // into the end frame, q^-1 * (p_start - t)
+        endKnots[k].leftCols<3>() = (R_end_start * R_s).cast<float>();
+        endKnots[k].col(3) = (R_end_start * (t_s - t)).cast<float>();
+    }
+    setSlopes(startKnots, startSlopes);
+    setSlopes(endKnots, endSlopes);
+}
+
+int SweepMotion::knot(const PointType &point, float &ratio) const
+{
+    if (!distortion)
+    {
+        ratio = 0;
+        return 0;
+    }
+    float relTime = (point.intensity - int(point.intensity)) * inverseScanPeriod;
+    float position = std::min(std::max(relTime, 0.0f), 1.0f) * numSegments;
+    int k = std::min(int(position), numSegments - 1);
+    ratio = position - k;
+    return k;
+}
+
+void SweepMotion::toStart(const PointType &in, PointType &out) const
+{
+    float ratio;
+    int k = knot(in, ratio);
+    Transform T = startKnots[k] + ratio * startSlopes[k];
+    Eigen::Vector3f p = T.leftCols<3>() * Eigen::Vector3f(in.x, in.y, in.z) + T.col(3);
+
+    out.x = p.x();
+    out.y = p.y();
+    out.z = p.z();
+    out.intensity = in.intensity;
+}
+
+void SweepMotion::toEnd(const pcl::PointCloud<PointType> &in, pcl::PointCloud<PointType> &out) const
+{
+    out = in;
+    const int cloudSize = in.points.size();
+    for (int i = 0; i < cloudSize; i++)
+    {
+        const PointType &point = in.points[i];
+        float ratio;
+        int k = knot(point, ratio);
+        Transform T = endKnots[k] + ratio * endSlopes[k];
+        Eigen::Vector3f p = T.leftCols<3>() * Eigen::Vector3f(point.x, point.y, point.z) + T.col(3);
+
+        PointType &pointEnd = out.points[i];
+        pointEnd.x = p.x();
+        pointEnd.y = p.y();
+        pointEnd.z = p.z();
+        pointEnd.intensity = int(point.intensity);
+    }
+}
@@ -0,0 +1,112 @@
+#include <memory>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "aloam_velodyne/frame_queue.h"
+
+typedef std::shared_ptr<const long> Frame;
+
+TEST(FrameQueue, KeepsOrderBelowCapacity)
+{
+    FrameQueue<Frame> queue(4);
+    EXPECT_TRUE(queue.empty());
+    for (long i = 0; i < 4; i++)
+        EXPECT_TRUE(queue.push(std::make_shared<const long>(i)));
+
+    for (long i = 0; i < 4; i++)
+    {
+        ASSERT_FALSE(queue.empty());
+        EXPECT_EQ(i, *queue.front());
+        queue.pop();
+    }
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(0u, queue.dropped());
+}
+
+TEST(FrameQueue, DropsOldestWhenFull)
+{
+    FrameQueue<Frame> queue(3);
+    for (long i = 0; i < 3; i++)
+        EXPECT_TRUE(queue.push(std::make_shared<const long>(i)));
+    EXPECT_FALSE(queue.push(std::make_shared<const long>(3)));
+    EXPECT_FALSE(queue.push(std::make_shared<const long>(4)));
+    EXPECT_EQ(2u, queue.dropped());
+
+    for (long i = 2; i < 5; i++)
+    {
+        ASSERT_FALSE(queue.empty());
+        EXPECT_EQ(i, *queue.front());
+        queue.pop();
+    }
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(FrameQueue, FrontIsNotDroppedUnderTheConsumer)
+{
+    FrameQueue<Frame> queue(2);
+    queue.push(std::make_shared<const long>(0));
+    queue.push(std::make_shared<const long>(1));
+
+    // the front moves to the consumer, the producer drops the next oldest
+    const Frame &front = queue.front();
+    queue.push(std::make_shared<const long>(2));
+    queue.push(std::make_shared<const long>(3));
+    queue.push(std::make_shared<const long>(4));
+    EXPECT_EQ(0, *front);
+    EXPECT_EQ(2u, queue.dropped());
+
+    long expected[] = {0, 3, 4};
+    for (long value : expected)
+    {
+        ASSERT_FALSE(queue.empty());
+        EXPECT_EQ(value, *queue.front());
+        queue.pop();
+    }
+    EXPECT_TRUE(queue.empty());
+}
+
+// one producer pushing as fast as it can against one consumer, every frame is
+// either received once in order or counted as dropped
+TEST(FrameQueue, ProducerAndConsumerThreads)
+{
+    const long numFrames = 200000;
+    FrameQueue<Frame> queue(4);
+
+    std::thread producer([&queue, numFrames]() {
+        for (long i = 0; i < numFrames; i++)
+            queue.push(std::make_shared<const long>(i));
+        queue.push(std::make_shared<const long>(-1));
+    });
+
+    long received = 0, last = -1;
+    bool ordered = true;
+    while (true)
+    {
+        if (queue.empty())
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        long value = *queue.front();
+        queue.pop();
+        if (value < 0)
+            break;
+        if (value <= last)
+            ordered = false;
+        last = value;
+        received++;
+    }
+    producer.join();
+
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(numFrames - 1, last);
+    EXPECT_EQ(numFrames, received + long(queue.dropped()));
+    EXPECT_TRUE(queue.empty());
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}